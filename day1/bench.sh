@@ -0,0 +1,62 @@
+#!/usr/bin/env bash
+# compares cat's read/write loop, splice and mmap paths on a cold and a warm
+# page cache, writing into a pipe so that every path is applicable.
+#
+# usage: ./bench.sh [SIZE_MB] [RUNS]
+#
+# the test file is created in $BENCH_DIR (default: this directory), use a
+# disk backed directory, a tmpfs can not drop its pages.
+set -euo pipefail
+
+size_mb=${1:-1024}
+runs=${2:-3}
+dir=${BENCH_DIR:-$(dirname "$0")}
+cat_bin=$(dirname "$0")/build/cat
+file=$dir/bench.data
+
+if [ ! -x "$cat_bin" ]; then
+  echo "build cat first (make)" >&2
+  exit 1
+fi
+
+trap 'rm -f "$file"' EXIT
+dd if=/dev/urandom of="$file" bs=1M count="$size_mb" status=none
+sync "$file"
+
+drop_cache() {
+  # drop_caches needs root, dd's nocache works for any file we can read
+  if [ -w /proc/sys/vm/drop_caches ]; then
+    echo 1 > /proc/sys/vm/drop_caches
+  fi
+  dd if="$file" iflag=nocache count=0 status=none
+}
+
+warm_cache() {
+  cat "$file" > /dev/null
+}
+
+# prints the wall clock seconds of a single run
+run_once() {
+  local mode=$1
+  local start end
+  start=$(date +%s%N)
+  "$cat_bin" -x "$mode" "$file" | cat > /dev/null
+  end=$(date +%s%N)
+  awk -v ns=$((end - start)) 'BEGIN { printf "%.4f\n", ns / 1e9 }'
+}
+
+echo "mode,cache,best_s,mib_per_s"
+for cache in cold warm; do
+  for mode in rw splice mmap; do
+    best=
+    for _ in $(seq "$runs"); do
+      if [ "$cache" = cold ]; then drop_cache; else warm_cache; fi
+      t=$(run_once "$mode")
+      if [ -z "$best" ] || awk -v t="$t" -v b="$best" 'BEGIN { exit !(t < b) }'; then
+        best=$t
+      fi
+    done
+    awk -v m="$mode" -v c="$cache" -v b="$best" -v s="$size_mb" \
+      'BEGIN { printf "%s,%s,%s,%.1f\n", m, c, b, s / b }'
+  done
+done
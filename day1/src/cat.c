@@ -1,59 +1,303 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 
-#define BUFLEN 512
+#include "uring.h"
 
-static size_t file_len(const int fd) {
-  off_t off = lseek(fd, 0, SEEK_END);
-  if (off < 0) {
-    fprintf(stderr, "failed to compute file length with errno %d", errno);
-    return 0;
+#define DEFAULT_BUFLEN (128 * 1024)
+
+// upper bound for a single zero-copy call, the kernel caps this further
+// (sendfile moves at most 0x7ffff000 bytes, splice at most a pipe's capacity)
+#define XFER_CHUNK (1UL << 30)
+
+// size of the windows the mmap path maps at once, unmapping each window
+// after it has been written keeps the resident set flat for huge files
+#define MMAP_WINDOW (64UL * 1024 * 1024)
+
+// set by -v, reports the transfer path taken for each file on stderr
+static bool verbose = false;
+
+// set by -u, queues all files on one io_uring instead of one after another
+static bool batched = false;
+
+// size of the read/write buffer, set by -b and rounded up to the page size
+static size_t buflen = DEFAULT_BUFLEN;
+
+// set by -m, regular files of at least this size are written from mmap'd
+// windows, 0 disables the mmap path
+static size_t mmap_threshold = 0;
+
+static int write_all(const int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t nwritten = write(fd, buf, len);
+    if (nwritten < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "write failed with errno %d\n", errno);
+      return 1;
+    }
+    buf += nwritten;
+    len -= nwritten;
   }
-  if (lseek(fd, 0, SEEK_SET) < 0) {
-    fprintf(stderr, "could not reset file offset, errno %d", errno);
-    return 0;
+  return 0;
+}
+
+// returns the page aligned read buffer, allocated on first use so that -b
+// can still change its size
+static char *stream_buffer(void) {
+  static char *buf = NULL;
+  if (!buf) {
+    int err = posix_memalign((void **)&buf, sysconf(_SC_PAGE_SIZE), buflen);
+    if (err != 0) {
+      fprintf(stderr, "failed to allocate %zu byte read buffer, errno %d\n", buflen, err);
+      buf = NULL;
+    }
   }
-  return off;
+  return buf;
 }
 
-static int read_chunk_to_stdout(const int fd, size_t *const ndone) {
-  if (lseek(fd, *ndone, SEEK_SET) < 0) {
-    fprintf(stderr, "could not set file to position %zu, errno %d\n", *ndone, errno);
+// reads fd sequentially until end of file and writes everything to stdout.
+// Never seeks, so this works on pipes, FIFOs and terminals as well.
+static int stream_to_stdout(const int fd, size_t *const ndone) {
+  char *buf = stream_buffer();
+  if (!buf) {
     return 1;
   }
+  // only a hint for readahead, fails with ESPIPE on pipes which is fine
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-  static char buf[BUFLEN];
-  memset(buf, '\0', BUFLEN);
-  ssize_t nread = read(fd, buf, BUFLEN);
-  if (nread < 0) {
-    switch (errno) {
-      case EBADF:
-        fprintf(stderr, "read failed due to invalid file descriptor\n");
-        break;
-      case EFAULT:
-        fprintf(stderr, "read buffer is outside of accesible address space\n");
-        break;
-      case EISDIR:
-        fprintf(stderr, "tried to read from directory\n");
-        break;
-      default:
-        fprintf(stderr, "read failed with errno %d", errno);
-        break;
+  while (true) {
+    ssize_t nread = read(fd, buf, buflen);
+    if (nread < 0) {
+      switch (errno) {
+        case EINTR:
+          continue;
+        case EBADF:
+          fprintf(stderr, "read failed due to invalid file descriptor\n");
+          break;
+        case EFAULT:
+          fprintf(stderr, "read buffer is outside of accesible address space\n");
+          break;
+        case EISDIR:
+          fprintf(stderr, "tried to read from directory\n");
+          break;
+        default:
+          fprintf(stderr, "read failed with errno %d\n", errno);
+          break;
+      }
+      return 1;
     }
+    if (nread == 0) {
+      return 0; // end of file
+    }
+    *ndone += nread;
+    if (write_all(STDOUT_FILENO, buf, nread) != 0) {
+      return 1;
+    }
+  }
+}
+
+// transfer strategies, ordered from most to least preferred
+enum xfer_mode {
+  XFER_COPY_FILE_RANGE,
+  XFER_SPLICE,
+  XFER_SENDFILE,
+  XFER_READ_WRITE,
+  XFER_MMAP,  // not part of the fallback chain, chosen by -m or -x
+  XFER_AUTO,
+};
+
+// set by -x, forces a single transfer path, mainly for benchmarking
+static enum xfer_mode forced_mode = XFER_AUTO;
+
+static const char *xfer_mode_str(enum xfer_mode mode) {
+  switch (mode) {
+    case XFER_COPY_FILE_RANGE:
+      return "copy_file_range";
+    case XFER_SPLICE:
+      return "splice";
+    case XFER_SENDFILE:
+      return "sendfile";
+    case XFER_READ_WRITE:
+      return "read/write";
+    case XFER_MMAP:
+      return "mmap";
+    default:
+      return "auto";
+  }
+}
+
+// checks whether a transfer mode can work for the given in- and output file
+// types, copy_file_range needs two regular files, splice needs a pipe on one
+// side and sendfile needs an input that is backed by the page cache
+static bool xfer_applicable(enum xfer_mode mode, const struct stat *in, const struct stat *out) {
+  switch (mode) {
+    case XFER_COPY_FILE_RANGE:
+      return S_ISREG(in->st_mode) && S_ISREG(out->st_mode);
+    case XFER_SPLICE:
+      return S_ISFIFO(in->st_mode) || S_ISFIFO(out->st_mode);
+    case XFER_SENDFILE:
+      return S_ISREG(in->st_mode) || S_ISBLK(in->st_mode);
+    default:
+      return true;
+  }
+}
+
+// errors that mean "this path does not work for this pair of files" rather
+// than an actual I/O failure, on these we retry with the next transfer mode
+static bool xfer_unsupported(int err) {
+  return err == EINVAL || err == ENOSYS || err == EXDEV || err == EOPNOTSUPP
+    || err == EBADF || err == ESPIPE;
+}
+
+// moves one chunk with the given mode, returns the number of bytes moved, 0
+// on end of file or -1 with errno set. All modes advance the file offsets of
+// both descriptors, so switching modes midway continues at the right position.
+static ssize_t xfer_chunk(enum xfer_mode mode, const int fd) {
+  switch (mode) {
+    case XFER_COPY_FILE_RANGE:
+      return copy_file_range(fd, NULL, STDOUT_FILENO, NULL, XFER_CHUNK, 0);
+    case XFER_SPLICE:
+      return splice(fd, NULL, STDOUT_FILENO, NULL, XFER_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+    case XFER_SENDFILE:
+      return sendfile(STDOUT_FILENO, fd, NULL, XFER_CHUNK);
+    default:
+      errno = ENOSYS;
+      return -1;
+  }
+}
+
+// writes the rest of a regular file straight from the page cache, mapping
+// one window at a time. The file must not shrink meanwhile, touching pages
+// past its end raises SIGBUS.
+static int mmap_to_stdout(const int fd, const struct stat *st, size_t *const ndone) {
+  off_t off = lseek(fd, 0, SEEK_CUR);
+  if (off < 0) {
+    fprintf(stderr, "could not get file offset, errno %d\n", errno);
     return 1;
   }
-  *ndone += nread;
-  printf("%s", buf);
+  const off_t page = sysconf(_SC_PAGE_SIZE);
+  while (off < st->st_size) {
+    // mmap offsets must be page aligned, an inherited fd may sit anywhere.
+    // Map from the page start and skip the bytes before off.
+    off_t map_off = off & ~(page - 1);
+    size_t skip = off - map_off;
+    size_t len = st->st_size - map_off;
+    if (len > MMAP_WINDOW) {
+      len = MMAP_WINDOW;
+    }
+    char *addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, map_off);
+    if (addr == MAP_FAILED) {
+      fprintf(stderr, "mmap failed with errno %d\n", errno);
+      return 1;
+    }
+    // hints only, MADV_SEQUENTIAL allows dropping pages behind us and
+    // MADV_WILLNEED starts reading the window in right away
+    madvise(addr, len, MADV_SEQUENTIAL);
+    madvise(addr, len, MADV_WILLNEED);
+    // overlap readahead of the next window with writing this one
+    posix_fadvise(fd, map_off + len, MMAP_WINDOW, POSIX_FADV_WILLNEED);
+
+    int rc = write_all(STDOUT_FILENO, addr + skip, len - skip);
+    if (munmap(addr, len) < 0) {
+      fprintf(stderr, "munmap failed with errno %d\n", errno);
+      rc = 1;
+    }
+    if (rc != 0) {
+      return rc;
+    }
+    off += len - skip;
+    *ndone += len - skip;
+  }
+  // leave the offset where a read would have left it
+  lseek(fd, off, SEEK_SET);
   return 0;
 }
 
+// copies the whole file behind fd to stdout, picking the cheapest transfer
+// path the kernel supports for this in-/output combination
+static int transfer_to_stdout(const int fd, const char *const filepath) {
+  static struct stat out_st;
+  static bool out_st_valid = false;
+  if (!out_st_valid) {
+    if (fstat(STDOUT_FILENO, &out_st) < 0) {
+      fprintf(stderr, "fstat on stdout failed with errno %d\n", errno);
+      return 1;
+    }
+    out_st_valid = true;
+  }
+  struct stat in_st;
+  if (fstat(fd, &in_st) < 0) {
+    fprintf(stderr, "fstat on %s failed with errno %d\n", filepath, errno);
+    return 1;
+  }
+
+  size_t ndone = 0;
+  enum xfer_mode mode = forced_mode;
+  if (mode == XFER_AUTO) {
+    bool huge = mmap_threshold > 0 && S_ISREG(in_st.st_mode) && (size_t)in_st.st_size >= mmap_threshold;
+    mode = huge ? XFER_MMAP : XFER_COPY_FILE_RANGE;
+  }
+  if (mode == XFER_MMAP && !S_ISREG(in_st.st_mode)) {
+    fprintf(stderr, "mmap cannot be used for %s, not a regular file\n", filepath);
+    return 1;
+  }
+
+  while (mode < XFER_READ_WRITE) {
+    if (!xfer_applicable(mode, &in_st, &out_st)) {
+      if (forced_mode != XFER_AUTO) {
+        fprintf(stderr, "%s cannot be used for %s\n", xfer_mode_str(mode), filepath);
+        return 1;
+      }
+      mode++;
+      continue;
+    }
+    ssize_t n = xfer_chunk(mode, fd);
+    if (n > 0) {
+      ndone += n;
+      continue;
+    }
+    if (n == 0) {
+      break; // end of file
+    }
+    if (errno == EINTR || errno == EAGAIN) {
+      continue;
+    }
+    if (!xfer_unsupported(errno) || forced_mode != XFER_AUTO) {
+      fprintf(stderr, "%s failed on %s with errno %d\n", xfer_mode_str(mode), filepath, errno);
+      return 1;
+    }
+    mode++;
+  }
+
+  int rc = 0;
+  if (mode == XFER_READ_WRITE) {
+    // continues wherever a zero-copy path stopped
+    rc = stream_to_stdout(fd, &ndone);
+  } else if (mode == XFER_MMAP) {
+    rc = mmap_to_stdout(fd, &in_st, &ndone);
+  }
+  if (verbose) {
+    fprintf(stderr, "%s: %zu bytes via %s\n", filepath, ndone, xfer_mode_str(mode));
+  }
+  return rc;
+}
+
 static int read_content(const char *const filepath) {
+  if (strcmp(filepath, "-") == 0) {
+    return transfer_to_stdout(STDIN_FILENO, "stdin");
+  }
+
   int fd = open(filepath, O_RDONLY);
   if (fd < 0) {
     switch (errno) {
@@ -73,13 +317,7 @@ static int read_content(const char *const filepath) {
     return 1;
   }
 
-  size_t flen = file_len(fd);
-  size_t nread = 0;
-  while (nread < flen) {
-    if (read_chunk_to_stdout(fd, &nread) != 0) {
-      break; // error during read
-    }
-  }
+  int rc = transfer_to_stdout(fd, filepath);
 
   if (close(fd) < 0) {
     switch (errno) {
@@ -92,18 +330,124 @@ static int read_content(const char *const filepath) {
     }
     return 1;
   }
-  return 0;
+  return rc;
 }
 
 static const char *next_file_path(int argc, char **argv) {
-  static int cur = 1;
+  static int cur = 0;
+  if (cur == 0) {
+    cur = optind;
+  }
   if (cur < argc) {
     return argv[cur++];
   }
   return NULL;
 }
 
+// parses sizes like "4096", "64k" or "2m"
+static size_t parse_size(const char *str) {
+  char *end = NULL;
+  errno = 0;
+  unsigned long long val = strtoull(str, &end, 10);
+  if (errno != 0 || end == str) {
+    return 0;
+  }
+  switch (*end) {
+    case 'k': case 'K':
+      val <<= 10;
+      end++;
+      break;
+    case 'm': case 'M':
+      val <<= 20;
+      end++;
+      break;
+    case 'g': case 'G':
+      val <<= 30;
+      end++;
+      break;
+    default:
+      break;
+  }
+  return *end == '\0' ? val : 0;
+}
+
+static enum xfer_mode parse_mode(const char *str) {
+  if (strcmp(str, "rw") == 0) {
+    return XFER_READ_WRITE;
+  }
+  for (enum xfer_mode mode = XFER_COPY_FILE_RANGE; mode <= XFER_AUTO; mode++) {
+    if (strcmp(str, xfer_mode_str(mode)) == 0) {
+      return mode;
+    }
+  }
+  return -1;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [-v] [-u] [-b SIZE] [-m SIZE] [-x MODE] [FILE]...\n", prog);
+  fprintf(stderr, "  -v       report the transfer path taken for each file on stderr\n");
+  fprintf(stderr, "  -u       batch opens, reads and writes of many files on an io_uring\n");
+  fprintf(stderr, "  -b SIZE  read buffer size for the read/write fallback (default 128k)\n");
+  fprintf(stderr, "  -m SIZE  write regular files of at least SIZE bytes from mmap'd windows\n");
+  fprintf(stderr, "  -x MODE  only use one transfer path, one of copy_file_range, splice,\n");
+  fprintf(stderr, "           sendfile, rw or mmap\n");
+  fprintf(stderr, "with no FILE, or when FILE is -, read standard input\n");
+}
+
 int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "vub:m:x:")) != -1) {
+    switch (opt) {
+      case 'v':
+        verbose = true;
+        break;
+      case 'u':
+        batched = true;
+        break;
+      case 'b': {
+        size_t pgsize = sysconf(_SC_PAGE_SIZE);
+        buflen = parse_size(optarg);
+        if (buflen == 0) {
+          fprintf(stderr, "invalid buffer size %s\n", optarg);
+          return 1;
+        }
+        buflen = (buflen + pgsize - 1) & ~(pgsize - 1);
+        break;
+      }
+      case 'm':
+        mmap_threshold = parse_size(optarg);
+        if (mmap_threshold == 0) {
+          fprintf(stderr, "invalid mmap threshold %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'x':
+        forced_mode = parse_mode(optarg);
+        if ((int)forced_mode < 0) {
+          fprintf(stderr, "unknown transfer mode %s\n", optarg);
+          return 1;
+        }
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (optind == argc) {
+    return read_content("-");
+  }
+
+  if (batched) {
+    int rc = uring_cat(argc - optind, &argv[optind], verbose);
+    if (rc >= 0) {
+      return rc;
+    }
+    if (verbose) {
+      fprintf(stderr, "io_uring is not available, falling back to sequential mode\n");
+    }
+  }
+
   const char *fpath = NULL;
   while ((fpath = next_file_path(argc, argv))) {
     read_content(fpath);
@@ -0,0 +1,396 @@
+#define _GNU_SOURCE
+#include "uring.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// read buffer per in-flight file, shard files usually fit in a single read
+#define URING_BUFLEN (64 * 1024)
+
+// minimal raw-syscall io_uring, just what uring_cat needs
+struct uring {
+  int fd;
+  unsigned sq_entries;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_sz;
+  void *cq_ring;
+  size_t cq_ring_sz;
+  size_t sqes_sz;
+  unsigned to_submit;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(SYS_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return syscall(SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// checks that the running kernel implements every opcode uring_cat submits
+static bool uring_supports_ops(struct uring *ring) {
+  static const uint8_t needed[] = {
+    IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE,
+  };
+  size_t len = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, len);
+  if (!probe) {
+    return false;
+  }
+  bool ok = sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+  for (size_t i = 0; ok && i < sizeof(needed); ++i) {
+    ok = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  return ok;
+}
+
+static void uring_exit(struct uring *ring) {
+  if (ring->sqes && ring->sqes != MAP_FAILED) {
+    munmap(ring->sqes, ring->sqes_sz);
+  }
+  if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_sz);
+  }
+  if (ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+    munmap(ring->sq_ring, ring->sq_ring_sz);
+  }
+  close(ring->fd);
+}
+
+static int uring_init(struct uring *ring, unsigned entries) {
+  memset(ring, 0, sizeof(*ring));
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  ring->fd = sys_io_uring_setup(entries, &p);
+  if (ring->fd < 0) {
+    return -1;
+  }
+  // writes to stdout go to its current file position (offset -1)
+  if (!(p.features & IORING_FEAT_RW_CUR_POS) || !uring_supports_ops(ring)) {
+    close(ring->fd);
+    return -1;
+  }
+
+  ring->sq_entries = p.sq_entries;
+  ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    if (ring->cq_ring_sz > ring->sq_ring_sz) {
+      ring->sq_ring_sz = ring->cq_ring_sz;
+    }
+    ring->cq_ring_sz = ring->sq_ring_sz;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    goto fail;
+  }
+  if (single_mmap) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      goto fail;
+    }
+  }
+  ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    goto fail;
+  }
+
+  char *sq = ring->sq_ring;
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+  char *cq = ring->cq_ring;
+  ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+
+fail:
+  uring_exit(ring);
+  return -1;
+}
+
+// the caller never has more than sq_entries operations in flight, so there
+// always is a free sqe
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+  unsigned tail = *ring->sq_tail;
+  unsigned idx = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[idx] = idx;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+  return sqe;
+}
+
+// submits everything queued so far and waits for at least wait_nr completions
+static int uring_submit_and_wait(struct uring *ring, unsigned wait_nr) {
+  while (true) {
+    int ret = sys_io_uring_enter(ring->fd, ring->to_submit, wait_nr,
+                                 wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    ring->to_submit -= ret;
+    return 0;
+  }
+}
+
+enum slot_state {
+  SLOT_FREE,
+  SLOT_OPENING,
+  SLOT_WAIT_HEAD, // stdin is only read once it is the head of the output
+  SLOT_READING,
+  SLOT_READY,     // holds data, written once it is the head of the output
+  SLOT_WRITING,
+  SLOT_CLOSING,
+};
+
+struct slot {
+  enum slot_state state;
+  int file;
+  int fd;
+  bool drained; // everything of this file has been written (or it failed)
+  char *buf;
+  size_t len;
+  size_t written;
+  uint64_t off;
+  size_t total;
+};
+
+static bool is_stdin(const char *path) {
+  return strcmp(path, "-") == 0;
+}
+
+static const char *display_name(const char *path) {
+  return is_stdin(path) ? "stdin" : path;
+}
+
+static void queue_open(struct uring *ring, struct slot *s, unsigned idx, const char *path) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t)path;
+  sqe->open_flags = O_RDONLY;
+  sqe->user_data = idx;
+  s->state = SLOT_OPENING;
+}
+
+static void queue_read(struct uring *ring, struct slot *s, unsigned idx) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = s->fd;
+  sqe->addr = (uintptr_t)s->buf;
+  sqe->len = URING_BUFLEN;
+  // stdin may be a pipe, read from its current position
+  sqe->off = s->fd == STDIN_FILENO ? (uint64_t)-1 : s->off;
+  sqe->user_data = idx;
+  s->state = SLOT_READING;
+}
+
+static void queue_write(struct uring *ring, struct slot *s, unsigned idx) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = STDOUT_FILENO;
+  sqe->addr = (uintptr_t)(s->buf + s->written);
+  sqe->len = s->len - s->written;
+  sqe->off = (uint64_t)-1;
+  sqe->user_data = idx;
+  s->state = SLOT_WRITING;
+}
+
+// stdin is not ours to close
+static void queue_close(struct uring *ring, struct slot *s, unsigned idx) {
+  s->drained = true;
+  if (s->fd == STDIN_FILENO) {
+    s->state = SLOT_FREE;
+    return;
+  }
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = s->fd;
+  sqe->user_data = idx;
+  s->state = SLOT_CLOSING;
+}
+
+int uring_cat(int nfiles, char **files, bool verbose) {
+  struct uring ring;
+  if (uring_init(&ring, URING_DEPTH) < 0) {
+    return -1;
+  }
+  unsigned depth = ring.sq_entries < URING_DEPTH ? ring.sq_entries : URING_DEPTH;
+
+  char *bufs = NULL;
+  int err = posix_memalign((void **)&bufs, sysconf(_SC_PAGE_SIZE), (size_t)depth * URING_BUFLEN);
+  if (err != 0) {
+    fprintf(stderr, "failed to allocate io_uring buffers, errno %d\n", err);
+    uring_exit(&ring);
+    return -1;
+  }
+  struct slot slots[URING_DEPTH];
+  for (unsigned i = 0; i < depth; ++i) {
+    memset(&slots[i], 0, sizeof(slots[i]));
+    slots[i].state = SLOT_FREE;
+    slots[i].buf = bufs + (size_t)i * URING_BUFLEN;
+  }
+
+  int rc = 0;
+  int head = 0; // next file whose data goes to stdout
+  int next = 0; // next file to open
+  unsigned inflight = 0;
+  while (head < nfiles || inflight > 0) {
+    // a file's slot is reused once the file depth places before it is closed
+    while (next < nfiles && next < head + (int)depth && slots[next % depth].state == SLOT_FREE) {
+      unsigned idx = next % depth;
+      struct slot *s = &slots[idx];
+      s->file = next;
+      s->drained = false;
+      s->off = 0;
+      s->total = 0;
+      if (is_stdin(files[next])) {
+        s->fd = STDIN_FILENO;
+        s->state = SLOT_WAIT_HEAD;
+      } else {
+        queue_open(&ring, s, idx, files[next]);
+        inflight++;
+      }
+      next++;
+    }
+
+    while (head < next) {
+      unsigned idx = head % depth;
+      struct slot *s = &slots[idx];
+      if (s->drained) {
+        if (verbose) {
+          fprintf(stderr, "%s: %zu bytes via io_uring\n", display_name(files[head]), s->total);
+        }
+        head++;
+        continue;
+      }
+      if (s->state == SLOT_READY) {
+        queue_write(&ring, s, idx);
+        inflight++;
+      } else if (s->state == SLOT_WAIT_HEAD) {
+        queue_read(&ring, s, idx);
+        inflight++;
+      }
+      break;
+    }
+    if (inflight == 0) {
+      continue;
+    }
+
+    if (uring_submit_and_wait(&ring, 1) < 0) {
+      fprintf(stderr, "io_uring_enter failed with errno %d\n", errno);
+      rc = 1;
+      break;
+    }
+
+    unsigned cq_head = *ring.cq_head;
+    unsigned cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; cq_head != cq_tail; ++cq_head) {
+      struct io_uring_cqe *cqe = &ring.cqes[cq_head & *ring.cq_mask];
+      unsigned idx = cqe->user_data;
+      int res = cqe->res;
+      struct slot *s = &slots[idx];
+      const char *path = files[s->file];
+      inflight--;
+
+      switch (s->state) {
+        case SLOT_OPENING:
+          if (res < 0) {
+            fprintf(stderr, "opening %s failed with errno %d\n", path, -res);
+            rc = 1;
+            s->drained = true;
+            s->state = SLOT_FREE;
+            break;
+          }
+          s->fd = res;
+          queue_read(&ring, s, idx);
+          inflight++;
+          break;
+        case SLOT_READING:
+          if (res < 0) {
+            fprintf(stderr, "reading %s failed with errno %d\n", display_name(path), -res);
+            rc = 1;
+          }
+          if (res <= 0) {
+            queue_close(&ring, s, idx);
+            inflight += s->state == SLOT_CLOSING;
+            break;
+          }
+          s->len = res;
+          s->written = 0;
+          s->off += res;
+          s->state = SLOT_READY;
+          break;
+        case SLOT_WRITING:
+          if (res < 0) {
+            fprintf(stderr, "write failed with errno %d\n", -res);
+            rc = 1;
+            goto out;
+          }
+          s->written += res;
+          s->total += res;
+          if (s->written < s->len) {
+            queue_write(&ring, s, idx);
+          } else {
+            queue_read(&ring, s, idx);
+          }
+          inflight++;
+          break;
+        case SLOT_CLOSING:
+          if (res < 0) {
+            fprintf(stderr, "closing %s failed with errno %d\n", path, -res);
+            rc = 1;
+          }
+          s->state = SLOT_FREE;
+          break;
+        default:
+          break;
+      }
+    }
+    __atomic_store_n(ring.cq_head, cq_head, __ATOMIC_RELEASE);
+  }
+
+out:
+  // tearing down the ring cancels whatever is still in flight
+  uring_exit(&ring);
+  free(bufs);
+  return rc;
+}
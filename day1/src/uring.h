@@ -0,0 +1,18 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+
+// number of files that are kept in flight at once by uring_cat
+#define URING_DEPTH 64
+
+// concatenates all files to stdout using a single io_uring, opens, reads and
+// closes of up to URING_DEPTH files are queued at the same time while writes
+// to stdout are issued strictly in argument order. A path of "-" is stdin.
+//
+// returns -1 without touching stdout if io_uring (or one of the operations
+// it needs) is not available, in which case the caller should fall back to
+// the synchronous path. Otherwise returns 0, or 1 if any file failed.
+int uring_cat(int nfiles, char **files, bool verbose);
+
+#endif
@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include "bench.h"
+#include "pool.h"
+#include "zygote.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <spawn.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <stdatomic.h>
+#include <linux/sched.h>
+
+#define BENCH_STACK_SIZE (64 * 1024)
+
+extern char **environ;
+
+// every strategy creates one child that exits right away and returns its
+// pid, or -1 on failure
+typedef pid_t (*spawn_fn)(void);
+
+static void *bench_stack = NULL;
+static char bench_uid_map[32];
+
+static int bench_child(void *args) {
+  return 0;
+}
+
+// same work as child_exec2 in main.c, minus the output
+static int bench_child_userns(void *args) {
+  int fd = open("/proc/self/uid_map", O_RDWR);
+  if (fd < 0) {
+    return 1;
+  }
+  write(fd, bench_uid_map, strlen(bench_uid_map));
+  close(fd);
+  return setuid(0) == -1;
+}
+
+static pid_t spawn_fork(void) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    _exit(0);
+  }
+  return pid;
+}
+
+static pid_t spawn_vfork(void) {
+  pid_t pid = vfork();
+  if (pid == 0) {
+    _exit(0);
+  }
+  return pid;
+}
+
+static pid_t spawn_clone(void) {
+  return clone(bench_child, (uint8_t *)bench_stack + BENCH_STACK_SIZE, SIGCHLD, NULL);
+}
+
+// the child runs on bench_stack, fine since we wait for it before the next
+static pid_t spawn_clone_vm(void) {
+  return clone(bench_child, (uint8_t *)bench_stack + BENCH_STACK_SIZE, CLONE_VM | SIGCHLD, NULL);
+}
+
+static pid_t spawn_clone3(void) {
+  struct clone_args args;
+  memset(&args, 0, sizeof(args));
+  args.exit_signal = SIGCHLD;
+  pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+  if (pid == 0) {
+    // no stack given, the child continues on a copy of ours
+    syscall(SYS_exit, 0);
+  }
+  return pid;
+}
+
+static pid_t spawn_posix_spawn(void) {
+  char *argv[] = {"true", NULL};
+  pid_t pid;
+  int err = posix_spawn(&pid, "/bin/true", NULL, NULL, argv, environ);
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  return pid;
+}
+
+static pid_t spawn_userns(void) {
+  return clone(bench_child_userns, (uint8_t *)bench_stack + BENCH_STACK_SIZE,
+               CLONE_NEWUSER | SIGCHLD, NULL);
+}
+
+static const struct {
+  const char *name;
+  spawn_fn spawn;
+} strategies[] = {
+  {"fork", spawn_fork},
+  {"vfork", spawn_vfork},
+  {"clone", spawn_clone},
+  {"clone_vm", spawn_clone_vm},
+  {"clone3", spawn_clone3},
+  {"posix_spawn", spawn_posix_spawn},
+  {"userns", spawn_userns},
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// grows the parent's resident set by touching rss_mb MiB of private memory,
+// fork has to copy the page tables of all of it
+static void *inflate_rss(unsigned rss_mb) {
+  if (rss_mb == 0) {
+    return NULL;
+  }
+  size_t len = (size_t)rss_mb << 20;
+  void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    fprintf(stderr, "mmap of %u MiB failed with errno %d\n", rss_mb, errno);
+    return NULL;
+  }
+  memset(mem, 0xa5, len);
+  return mem;
+}
+
+// returns 0 on success, 1 if the strategy is not usable here
+static int bench_one(unsigned s, unsigned rss_mb, unsigned nchildren, uint64_t *lat) {
+  uint64_t start = now_ns();
+  for (unsigned i = 0; i < nchildren; ++i) {
+    uint64_t t0 = now_ns();
+    pid_t pid = strategies[s].spawn();
+    if (pid == -1) {
+      fprintf(stderr, "%s: spawn failed with errno %d, skipping\n", strategies[s].name, errno);
+      return 1;
+    }
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+      fprintf(stderr, "%s: waitpid failed with errno %d\n", strategies[s].name, errno);
+      return 1;
+    }
+    lat[i] = now_ns() - t0;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "%s: child failed with status %d, skipping\n", strategies[s].name, status);
+      return 1;
+    }
+  }
+  uint64_t total = now_ns() - start;
+
+  qsort(lat, nchildren, sizeof(*lat), cmp_u64);
+  uint64_t p50 = lat[nchildren / 2];
+  uint64_t p99 = lat[(nchildren * 99) / 100 < nchildren ? (nchildren * 99) / 100 : nchildren - 1];
+  printf("%s,%u,%u,%.1f,%.1f,%.0f\n", strategies[s].name, rss_mb, nchildren,
+         p50 / 1e3, p99 / 1e3, nchildren / (total / 1e9));
+  fflush(stdout);
+  return 0;
+}
+
+int spawn_bench(unsigned nchildren, const unsigned *rss_mb, unsigned nrss) {
+  if (nchildren == 0) {
+    return 1;
+  }
+  uint64_t *lat = calloc(nchildren, sizeof(*lat));
+  bench_stack = stack_alloc(BENCH_STACK_SIZE);
+  if (!lat || !bench_stack) {
+    fprintf(stderr, "failed to allocate benchmark buffers\n");
+    free(lat);
+    return 1;
+  }
+  snprintf(bench_uid_map, sizeof(bench_uid_map), "0 %d 1\n", getuid());
+  // children are already flushed, don't let them inherit pending output
+  fflush(stdout);
+
+  printf("strategy,rss_mb,children,p50_us,p99_us,spawns_per_s\n");
+  for (unsigned r = 0; r < nrss; ++r) {
+    void *mem = inflate_rss(rss_mb[r]);
+    if (rss_mb[r] > 0 && !mem) {
+      continue;
+    }
+    for (unsigned s = 0; s < sizeof(strategies) / sizeof(*strategies); ++s) {
+      bench_one(s, rss_mb[r], nchildren, lat);
+    }
+    if (mem) {
+      munmap(mem, (size_t)rss_mb[r] << 20);
+    }
+  }
+  stack_release(bench_stack, BENCH_STACK_SIZE);
+  free(lat);
+  return 0;
+}
+
+// job start times of the sandboxes, shared with them
+static uint64_t *zygote_started = NULL;
+
+static int zygote_bench_job(uint64_t arg) {
+  zygote_started[arg] = now_ns();
+  return 0;
+}
+
+static int zygote_bench_cold_child(void *args) {
+  if (bench_child_userns(args) != 0) {
+    return 1;
+  }
+  return zygote_bench_job((uint64_t)(uintptr_t)args);
+}
+
+static void zygote_bench_report(const char *mode, unsigned nstarts, unsigned nslots,
+                                uint64_t *lat, uint64_t wall, uint64_t busy) {
+  qsort(lat, nstarts, sizeof(*lat), cmp_u64);
+  uint64_t p50 = lat[nstarts / 2];
+  uint64_t p99 = lat[(nstarts * 99) / 100 < nstarts ? (nstarts * 99) / 100 : nstarts - 1];
+  printf("%s,%u,%u,%.1f,%.1f,%.0f,%.0f\n", mode, nslots, nstarts, p50 / 1e3, p99 / 1e3,
+         nstarts / (wall / 1e9), nstarts / (busy / 1e9));
+  fflush(stdout);
+}
+
+int zygote_bench(unsigned nstarts, unsigned nslots) {
+  if (nstarts == 0 || nslots == 0) {
+    return 1;
+  }
+  size_t len = nstarts * sizeof(uint64_t);
+  zygote_started = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  uint64_t *lat = calloc(nstarts, sizeof(*lat));
+  bench_stack = stack_alloc(BENCH_STACK_SIZE);
+  if (zygote_started == MAP_FAILED || !lat || !bench_stack) {
+    fprintf(stderr, "failed to allocate benchmark buffers\n");
+    return 1;
+  }
+  snprintf(bench_uid_map, sizeof(bench_uid_map), "0 %d 1\n", getuid());
+  fflush(stdout);
+  printf("mode,slots,starts,p50_us,p99_us,starts_per_s,starts_per_s_excl_refill\n");
+
+  int rc = 0;
+  uint64_t start = now_ns();
+  for (unsigned i = 0; i < nstarts; ++i) {
+    uint64_t t0 = now_ns();
+    pid_t pid = clone(zygote_bench_cold_child, (uint8_t *)bench_stack + BENCH_STACK_SIZE,
+                      CLONE_NEWUSER | SIGCHLD, (void *)(uintptr_t)i);
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) == -1 || status != 0) {
+      fprintf(stderr, "cold sandbox start failed, errno %d\n", errno);
+      rc = 1;
+      goto out;
+    }
+    lat[i] = zygote_started[i] - t0;
+  }
+  uint64_t cold = now_ns() - start;
+  zygote_bench_report("cold", nstarts, 0, lat, cold, cold);
+
+  struct zygote z;
+  if (zygote_start(&z, nslots, zygote_bench_job) == -1) {
+    rc = 1;
+    goto out;
+  }
+  uint64_t waited = 0;
+  start = now_ns();
+  for (unsigned i = 0; i < nstarts; ++i) {
+    // keep the time spent waiting for refills apart from the starts themselves
+    uint64_t w0 = now_ns();
+    while (atomic_load(&z.shared->nready) == 0 && !atomic_load(&z.shared->broken)) {
+      sched_yield();
+    }
+    uint64_t t0 = now_ns();
+    waited += t0 - w0;
+    pid_t pid = zygote_run(&z, i);
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) == -1 || status != 0) {
+      fprintf(stderr, "pooled sandbox start failed, errno %d\n", errno);
+      rc = 1;
+      break;
+    }
+    lat[i] = zygote_started[i] - t0;
+  }
+  uint64_t wall = now_ns() - start;
+  zygote_stop(&z);
+  if (rc == 0) {
+    zygote_bench_report("pooled", nstarts, nslots, lat, wall, wall - waited);
+  }
+
+out:
+  stack_release(bench_stack, BENCH_STACK_SIZE);
+  munmap(zygote_started, len);
+  free(lat);
+  return rc;
+}
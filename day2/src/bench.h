@@ -0,0 +1,16 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// creates nchildren children with every strategy (fork, vfork, clone with
+// and without CLONE_VM, clone3, posix_spawn and a new user namespace) once
+// for each parent RSS in rss_mb, and prints spawn-to-exit latency
+// percentiles and throughput as CSV on stdout
+int spawn_bench(unsigned nchildren, const unsigned *rss_mb, unsigned nrss);
+
+// starts nstarts sandboxes in a fresh user namespace, once cold with
+// clone(CLONE_NEWUSER) plus uid_map setup and once handed out by a zygote
+// that keeps nslots of them warm, and prints request-to-job-start latency
+// as CSV on stdout
+int zygote_bench(unsigned nstarts, unsigned nslots);
+
+#endif
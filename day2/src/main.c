@@ -9,8 +9,13 @@
 #include <sched.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <sys/resource.h>
 
-#define STACK_SIZE 4096
+#include "pool.h"
+#include "bench.h"
+#include "supervisor.h"
+
+#define STACK_SIZE (64 * 1024)
 
 char message[128];
 
@@ -46,13 +51,15 @@ int child_exec2(void *args) {
 
 // child and parent have different pids and different address spaces
 pid_t cl_fork() {
-  char *childstack = (char *)calloc(STACK_SIZE, sizeof(char));
+  char *childstack = stack_alloc(STACK_SIZE);
   if (!childstack) {
     fprintf(stderr, "failed to allocate child stack\n");
     return -1;
   }
   int flags = 0;
   pid_t pid = clone(child_exec, childstack + STACK_SIZE, flags | SIGCHLD, NULL);
+  // the child runs on its own copy of the stack
+  stack_release(childstack, STACK_SIZE);
   if (pid == -1) {
     fprintf(stderr, "clone failed with errno %d\n", errno);
     return -1;
@@ -61,7 +68,7 @@ pid_t cl_fork() {
 }
 
 pid_t cl_fork_new_uid_namespace() {
-  char *childstack = (char *)calloc(STACK_SIZE, sizeof(char));
+  char *childstack = stack_alloc(STACK_SIZE);
   if (!childstack) {
     fprintf(stderr, "failed to allocate child stack\n");
     return -1;
@@ -71,6 +78,7 @@ pid_t cl_fork_new_uid_namespace() {
 
   int flags = CLONE_NEWUSER;
   pid_t pid = clone(child_exec2, childstack + STACK_SIZE, flags | SIGCHLD, (void *)uid_map);
+  stack_release(childstack, STACK_SIZE);
   if (pid == -1) {
     fprintf(stderr, "clone failed with errno %d\n", errno);
     return -1;
@@ -81,7 +89,7 @@ pid_t cl_fork_new_uid_namespace() {
 
 // child and parent have different pids but the same address space
 pid_t cl_chimera() {
-  char *childstack = (char *)calloc(STACK_SIZE, sizeof(char));
+  char *childstack = stack_alloc(STACK_SIZE);
   if (!childstack) {
     fprintf(stderr, "failed to allocate child stack\n");
     return -1;
@@ -97,7 +105,7 @@ pid_t cl_chimera() {
 
 // spaws a new thread in the same "process" ~ "thread group" as the caller
 pid_t cl_thread() {
-  char *childstack = (char *)calloc(STACK_SIZE, sizeof(char));
+  char *childstack = stack_alloc(STACK_SIZE);
   if (!childstack) {
     fprintf(stderr, "failed to allocate child stack\n");
     return -1;
@@ -111,6 +119,115 @@ pid_t cl_thread() {
   return pid;
 }
 
+struct pool_job {
+  unsigned id;
+  unsigned long sum;
+};
+
+// runs on a pool worker, which shares our TLS, so only snprintf + write here
+static void pool_task(void *args) {
+  struct pool_job *job = args;
+  for (unsigned long i = 0; i < 1000000; ++i) {
+    job->sum += i ^ job->id;
+  }
+  char line[128];
+  int len = snprintf(line, sizeof(line), "worker %d: job %u done, sum %lu\n",
+                     gettid(), job->id, job->sum);
+  write(STDOUT_FILENO, line, len);
+}
+
+// runs a few rounds of jobs on a pool, the second pool reuses the stacks the
+// first one released
+static int run_pool(void) {
+  struct pool_job jobs[16];
+  for (int round = 0; round < 2; ++round) {
+    struct worker_pool *pool = pool_create(4, POOL_STACK_SIZE);
+    if (!pool) {
+      return 1;
+    }
+    for (unsigned i = 0; i < 16; ++i) {
+      jobs[i].id = i;
+      jobs[i].sum = 0;
+      if (pool_submit(pool, pool_task, &jobs[i]) == -1) {
+        pool_destroy(pool);
+        return 1;
+      }
+    }
+    pool_wait(pool);
+    printf("parent: round %d, stack of worker 0 at %p\n", round, pool->workers[0].stack);
+    pool_destroy(pool);
+  }
+  return 0;
+}
+
+// sleeps for a few ms and exits with its index, so exits arrive out of order
+static int reap_child(void *args) {
+  unsigned idx = (unsigned)(uintptr_t)args;
+  usleep((idx * 7919) % 50 * 1000);
+  return idx % 256;
+}
+
+// main reap [CHILDREN]
+static int run_reap(int argc, char **argv) {
+  unsigned nchildren = argc > 2 ? strtoul(argv[2], NULL, 10) : 64;
+  // every running child holds a pidfd
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  struct supervisor sv;
+  if (supervisor_init(&sv, nchildren) == -1) {
+    return 1;
+  }
+  fflush(stdout);
+  for (unsigned i = 0; i < nchildren; ++i) {
+    if (supervisor_spawn(&sv, reap_child, (void *)(uintptr_t)i) == -1) {
+      break;
+    }
+  }
+
+  struct child_exit exits[64];
+  while (sv.running > 0) {
+    int n = supervisor_reap(&sv, exits, 64, -1);
+    if (n == -1) {
+      supervisor_destroy(&sv);
+      return 1;
+    }
+    for (int i = 0; i < n; ++i) {
+      printf("parent: reaped pid %d, %s %d after %.2f ms\n", exits[i].pid,
+             exits[i].code == CLD_EXITED ? "exit code" : "signal", exits[i].status,
+             exits[i].runtime_ns / 1e6);
+    }
+  }
+  supervisor_destroy(&sv);
+  return 0;
+}
+
+// main zygote [STARTS] [SLOTS]
+static int run_zygote(int argc, char **argv) {
+  unsigned nstarts = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000;
+  unsigned nslots = argc > 3 ? strtoul(argv[3], NULL, 10) : 16;
+  return zygote_bench(nstarts, nslots);
+}
+
+// main bench [CHILDREN] [RSS_MB,...]
+static int run_bench(int argc, char **argv) {
+  unsigned nchildren = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000;
+  unsigned rss_mb[16] = {0, 256};
+  unsigned nrss = 2;
+  if (argc > 3) {
+    nrss = 0;
+    char *tok = strtok(argv[3], ",");
+    while (tok && nrss < 16) {
+      rss_mb[nrss++] = strtoul(tok, NULL, 10);
+      tok = strtok(NULL, ",");
+    }
+  }
+  return spawn_bench(nchildren, rss_mb, nrss);
+}
+
 int main(int argc, char **argv) {
   if (argc < 2) {
     return 1;
@@ -148,6 +265,14 @@ int main(int argc, char **argv) {
       fprintf(stderr, "error on wait, errno %d\n", errno);
       return 1;
     }
+  } else if (strncmp(argv[1], "reap", 5) == 0) {
+    return run_reap(argc, argv);
+  } else if (strncmp(argv[1], "zygote", 7) == 0) {
+    return run_zygote(argc, argv);
+  } else if (strncmp(argv[1], "bench", 6) == 0) {
+    return run_bench(argc, argv);
+  } else if (strncmp(argv[1], "pool", 5) == 0) {
+    return run_pool();
   } else if (strncmp(argv[1], "thread", 7) == 0) {
     cl_thread();
     printf("parent: my pid is %d\n", getpid());
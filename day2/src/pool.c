@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// number of released stacks kept around for reuse
+#define STACK_CACHE_MAX 64
+
+enum worker_state {
+  WORKER_IDLE,
+  WORKER_TASK,
+  WORKER_EXIT,
+};
+
+static int futex(atomic_int *uaddr, int op, int val) {
+  return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+// futex for the workers. syscall() sets errno, which lives in the TLS the
+// workers share with the thread that created them, and FUTEX_WAIT fails
+// with EAGAIN all the time. Returns -errno instead.
+static long worker_futex(atomic_int *uaddr, int op, int val) {
+#if defined(__x86_64__)
+  register long r10 __asm__("r10") = 0;
+  long ret;
+  __asm__ volatile("syscall"
+                   : "=a"(ret)
+                   : "0"((long)SYS_futex), "D"(uaddr), "S"((long)op), "d"((long)val), "r"(r10)
+                   : "rcx", "r11", "memory");
+  return ret;
+#elif defined(__aarch64__)
+  register long x8 __asm__("x8") = SYS_futex;
+  register long x0 __asm__("x0") = (long)uaddr;
+  register long x1 __asm__("x1") = op;
+  register long x2 __asm__("x2") = val;
+  register long x3 __asm__("x3") = 0;
+  __asm__ volatile("svc 0" : "+r"(x0) : "r"(x8), "r"(x1), "r"(x2), "r"(x3) : "memory");
+  return x0;
+#else
+#error "worker_futex needs a raw syscall for this architecture"
+#endif
+}
+
+static size_t page_size(void) {
+  static size_t pgsize = 0;
+  if (pgsize == 0) {
+    pgsize = sysconf(_SC_PAGE_SIZE);
+  }
+  return pgsize;
+}
+
+static size_t stack_round(size_t size) {
+  return (size + page_size() - 1) & ~(page_size() - 1);
+}
+
+// cache of released stacks, only touched by the thread that owns the pools
+static struct {
+  void *stack;
+  size_t size;
+} stack_cache[STACK_CACHE_MAX];
+static unsigned stack_cache_len = 0;
+
+void *stack_alloc(size_t size) {
+  size = stack_round(size);
+  for (unsigned i = 0; i < stack_cache_len; ++i) {
+    if (stack_cache[i].size == size) {
+      void *stack = stack_cache[i].stack;
+      stack_cache[i] = stack_cache[--stack_cache_len];
+      return stack;
+    }
+  }
+
+  // the guard page sits below the stack since stacks grow down
+  size_t guard = page_size();
+  uint8_t *base = mmap(NULL, size + guard, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "mmap of child stack failed with errno %d\n", errno);
+    return NULL;
+  }
+  if (mprotect(base, guard, PROT_NONE) == -1) {
+    fprintf(stderr, "mprotect of stack guard page failed with errno %d\n", errno);
+    munmap(base, size + guard);
+    return NULL;
+  }
+  return base + guard;
+}
+
+void stack_release(void *stack, size_t size) {
+  size = stack_round(size);
+  if (stack_cache_len < STACK_CACHE_MAX) {
+    stack_cache[stack_cache_len].stack = stack;
+    stack_cache[stack_cache_len].size = size;
+    stack_cache_len++;
+    return;
+  }
+  munmap((uint8_t *)stack - page_size(), size + page_size());
+}
+
+static int worker_main(void *args) {
+  struct worker *w = args;
+  struct worker_pool *pool = w->pool;
+  while (true) {
+    int state = atomic_load(&w->state);
+    if (state == WORKER_IDLE) {
+      worker_futex(&w->state, FUTEX_WAIT_PRIVATE, WORKER_IDLE);
+      continue;
+    }
+    if (state == WORKER_EXIT) {
+      break;
+    }
+    w->fn(w->arg);
+    atomic_store(&w->state, WORKER_IDLE);
+    // only pay for a wake up if pool_submit or pool_wait is sleeping
+    atomic_fetch_sub(&pool->busy, 1);
+    if (atomic_load(&pool->waiters) > 0) {
+      worker_futex(&pool->busy, FUTEX_WAKE_PRIVATE, INT_MAX);
+    }
+  }
+  return 0;
+}
+
+static int worker_spawn(struct worker *w) {
+  w->stack = stack_alloc(w->pool->stack_size);
+  if (!w->stack) {
+    return -1;
+  }
+  atomic_init(&w->state, WORKER_IDLE);
+  int flags = CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD
+    | CLONE_SYSVSEM | CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID;
+  pid_t tid = clone(worker_main, (uint8_t *)w->stack + stack_round(w->pool->stack_size),
+                    flags, w, (pid_t *)&w->tid, NULL, (pid_t *)&w->tid);
+  if (tid == -1) {
+    fprintf(stderr, "clone failed with errno %d\n", errno);
+    stack_release(w->stack, w->pool->stack_size);
+    w->stack = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+// the kernel clears the tid and does a (non-private) futex wake on it once
+// the worker has exited, only then its stack may be reused
+static void worker_join(struct worker *w) {
+  int tid;
+  while ((tid = atomic_load(&w->tid)) != 0) {
+    futex(&w->tid, FUTEX_WAIT, tid);
+  }
+  stack_release(w->stack, w->pool->stack_size);
+  w->stack = NULL;
+}
+
+// sleeps on the busy counter while it equals val
+static void pool_wait_busy(struct worker_pool *pool, int val) {
+  atomic_fetch_add(&pool->waiters, 1);
+  while (atomic_load(&pool->busy) == val) {
+    futex(&pool->busy, FUTEX_WAIT_PRIVATE, val);
+  }
+  atomic_fetch_sub(&pool->waiters, 1);
+}
+
+static void pool_stop(struct worker_pool *pool, unsigned n) {
+  for (unsigned i = 0; i < n; ++i) {
+    atomic_store(&pool->workers[i].state, WORKER_EXIT);
+    futex(&pool->workers[i].state, FUTEX_WAKE_PRIVATE, 1);
+  }
+  for (unsigned i = 0; i < n; ++i) {
+    worker_join(&pool->workers[i]);
+  }
+}
+
+struct worker_pool *pool_create(unsigned nworkers, size_t stack_size) {
+  struct worker_pool *pool = calloc(1, sizeof(*pool));
+  if (!pool) {
+    fprintf(stderr, "failed to allocate worker pool\n");
+    return NULL;
+  }
+  pool->workers = calloc(nworkers, sizeof(*pool->workers));
+  if (!pool->workers) {
+    fprintf(stderr, "failed to allocate workers\n");
+    free(pool);
+    return NULL;
+  }
+  pool->nworkers = nworkers;
+  pool->stack_size = stack_size;
+  atomic_init(&pool->busy, 0);
+  atomic_init(&pool->waiters, 0);
+  for (unsigned i = 0; i < nworkers; ++i) {
+    pool->workers[i].pool = pool;
+    if (worker_spawn(&pool->workers[i]) == -1) {
+      pool_stop(pool, i);
+      free(pool->workers);
+      free(pool);
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+int pool_submit(struct worker_pool *pool, pool_task_fn fn, void *arg) {
+  while (true) {
+    for (unsigned i = 0; i < pool->nworkers; ++i) {
+      struct worker *w = &pool->workers[i];
+      if (atomic_load(&w->state) != WORKER_IDLE) {
+        continue;
+      }
+      w->fn = fn;
+      w->arg = arg;
+      atomic_fetch_add(&pool->busy, 1);
+      atomic_store(&w->state, WORKER_TASK);
+      if (futex(&w->state, FUTEX_WAKE_PRIVATE, 1) == -1) {
+        fprintf(stderr, "futex wake failed with errno %d\n", errno);
+        return -1;
+      }
+      return 0;
+    }
+    pool_wait_busy(pool, pool->nworkers);
+  }
+}
+
+void pool_wait(struct worker_pool *pool) {
+  int busy;
+  while ((busy = atomic_load(&pool->busy)) > 0) {
+    pool_wait_busy(pool, busy);
+  }
+}
+
+void pool_destroy(struct worker_pool *pool) {
+  pool_wait(pool);
+  pool_stop(pool, pool->nworkers);
+  free(pool->workers);
+  free(pool);
+}
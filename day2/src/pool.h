@@ -0,0 +1,55 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+// default usable stack size of a pool worker, excluding its guard page
+#define POOL_STACK_SIZE (128 * 1024)
+
+// allocates a stack of at least size bytes with a PROT_NONE guard page below
+// it, reusing a previously released stack of the same size when possible.
+// Returns a pointer to the lowest usable byte or NULL on failure.
+void *stack_alloc(size_t size);
+
+// hands a stack back to the cache, it must not be in use by any task anymore
+void stack_release(void *stack, size_t size);
+
+typedef void (*pool_task_fn)(void *arg);
+
+struct worker {
+  atomic_int state;     // futex word the parked worker sleeps on
+  pool_task_fn fn;
+  void *arg;
+  atomic_int tid;       // cleared by the kernel when the worker exits
+  void *stack;
+  struct worker_pool *pool;
+};
+
+struct worker_pool {
+  unsigned nworkers;
+  size_t stack_size;
+  atomic_int busy;      // futex word, number of workers running a task
+  atomic_int waiters;   // threads sleeping on busy
+  struct worker *workers;
+};
+
+// spawns nworkers threads with clone(CLONE_VM | CLONE_THREAD | ...) that park
+// on a futex until they receive a task. The workers share the caller's TLS
+// since no CLONE_SETTLS is done, so tasks must not use stdio, malloc or
+// anything else that relies on per-thread state of libc, errno included.
+// The workers themselves make their syscalls without touching errno.
+struct worker_pool *pool_create(unsigned nworkers, size_t stack_size);
+
+// hands fn(arg) to an idle worker, blocks while all workers are busy.
+// Must only be called from the thread that created the pool.
+int pool_submit(struct worker_pool *pool, pool_task_fn fn, void *arg);
+
+// blocks until every submitted task has finished
+void pool_wait(struct worker_pool *pool);
+
+// waits for all tasks, lets the workers exit and recycles their stacks
+void pool_destroy(struct worker_pool *pool);
+
+#endif
@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include "supervisor.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/sched.h>
+
+// maximum number of exits handled per epoll_wait
+#define SV_EVENTS 64
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int supervisor_init(struct supervisor *sv, unsigned max_children) {
+  memset(sv, 0, sizeof(*sv));
+  sv->children = calloc(max_children, sizeof(*sv->children));
+  if (!sv->children) {
+    fprintf(stderr, "failed to allocate child table\n");
+    return -1;
+  }
+  sv->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (sv->epfd == -1) {
+    fprintf(stderr, "epoll_create1 failed with errno %d\n", errno);
+    free(sv->children);
+    return -1;
+  }
+  sv->max_children = max_children;
+  for (unsigned i = 0; i < max_children; ++i) {
+    sv->children[i].pidfd = -1;
+    sv->children[i].next_free = i + 1 < max_children ? &sv->children[i + 1] : NULL;
+  }
+  sv->free_list = max_children > 0 ? &sv->children[0] : NULL;
+  return 0;
+}
+
+pid_t supervisor_spawn(struct supervisor *sv, int (*fn)(void *), void *arg) {
+  struct sv_child *child = sv->free_list;
+  if (!child) {
+    fprintf(stderr, "supervisor is full (%u children)\n", sv->max_children);
+    return -1;
+  }
+
+  int pidfd = -1;
+  struct clone_args args;
+  memset(&args, 0, sizeof(args));
+  args.flags = CLONE_PIDFD;
+  args.pidfd = (uintptr_t)&pidfd;
+  args.exit_signal = SIGCHLD;
+  uint64_t start = now_ns();
+  pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+  if (pid == -1) {
+    fprintf(stderr, "clone3 failed with errno %d\n", errno);
+    return -1;
+  }
+  if (pid == 0) {
+    // no stack given, the child continues on a copy of ours
+    _exit(fn(arg));
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = child;
+  if (epoll_ctl(sv->epfd, EPOLL_CTL_ADD, pidfd, &ev) == -1) {
+    fprintf(stderr, "epoll_ctl failed with errno %d\n", errno);
+    // still reap it, otherwise it stays a zombie
+    siginfo_t info;
+    waitid(P_PIDFD, pidfd, &info, WEXITED);
+    close(pidfd);
+    return -1;
+  }
+  sv->free_list = child->next_free;
+  child->pidfd = pidfd;
+  child->pid = pid;
+  child->start_ns = start;
+  sv->running++;
+  return pid;
+}
+
+static int sv_reap_child(struct supervisor *sv, struct sv_child *child, struct child_exit *ex) {
+  siginfo_t info;
+  memset(&info, 0, sizeof(info));
+  if (waitid(P_PIDFD, child->pidfd, &info, WEXITED) == -1) {
+    fprintf(stderr, "waitid on pid %d failed with errno %d\n", child->pid, errno);
+    return -1;
+  }
+  ex->pid = child->pid;
+  ex->code = info.si_code;
+  ex->status = info.si_status;
+  ex->runtime_ns = now_ns() - child->start_ns;
+
+  // children forked later hold copies of this pidfd, so closing it alone
+  // would leave it in the epoll set
+  epoll_ctl(sv->epfd, EPOLL_CTL_DEL, child->pidfd, NULL);
+  close(child->pidfd);
+  child->pidfd = -1;
+  child->next_free = sv->free_list;
+  sv->free_list = child;
+  sv->running--;
+  return 0;
+}
+
+int supervisor_reap(struct supervisor *sv, struct child_exit *exits, unsigned max, int timeout_ms) {
+  if (max > SV_EVENTS) {
+    max = SV_EVENTS;
+  }
+  struct epoll_event events[SV_EVENTS];
+  int n;
+  do {
+    n = epoll_wait(sv->epfd, events, max, timeout_ms);
+  } while (n == -1 && errno == EINTR);
+  if (n == -1) {
+    fprintf(stderr, "epoll_wait failed with errno %d\n", errno);
+    return -1;
+  }
+  int nexits = 0;
+  for (int i = 0; i < n; ++i) {
+    if (sv_reap_child(sv, events[i].data.ptr, &exits[nexits]) == 0) {
+      nexits++;
+    }
+  }
+  return nexits;
+}
+
+void supervisor_destroy(struct supervisor *sv) {
+  for (unsigned i = 0; i < sv->max_children; ++i) {
+    struct sv_child *child = &sv->children[i];
+    if (child->pidfd == -1) {
+      continue;
+    }
+    syscall(SYS_pidfd_send_signal, child->pidfd, SIGKILL, NULL, 0);
+    struct child_exit ex;
+    sv_reap_child(sv, child, &ex);
+  }
+  close(sv->epfd);
+  free(sv->children);
+}
@@ -0,0 +1,46 @@
+#ifndef SUPERVISOR_H
+#define SUPERVISOR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct sv_child {
+  int pidfd;
+  pid_t pid;
+  uint64_t start_ns;
+  struct sv_child *next_free;
+};
+
+struct child_exit {
+  pid_t pid;
+  int code;           // CLD_EXITED, CLD_KILLED or CLD_DUMPED
+  int status;         // exit code or signal number, depending on code
+  uint64_t runtime_ns;
+};
+
+// supervises up to max_children children at once, each child is created with
+// clone3(CLONE_PIDFD) and its pidfd sits in an epoll set, so reaping only
+// looks at children that actually exited
+struct supervisor {
+  int epfd;
+  unsigned max_children;
+  unsigned running;
+  struct sv_child *children;
+  struct sv_child *free_list;
+};
+
+int supervisor_init(struct supervisor *sv, unsigned max_children);
+
+// forks a child that runs fn(arg) and exits with its return value, returns
+// the child's pid or -1 (also when max_children are already running)
+pid_t supervisor_spawn(struct supervisor *sv, int (*fn)(void *), void *arg);
+
+// waits up to timeout_ms (-1 blocks) for children to exit and reaps at most
+// max of them with waitid(P_PIDFD), returns the number of entries filled in
+// exits or -1 on error
+int supervisor_reap(struct supervisor *sv, struct child_exit *exits, unsigned max, int timeout_ms);
+
+// kills and reaps all children that are still running
+void supervisor_destroy(struct supervisor *sv);
+
+#endif
@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+#include "zygote.h"
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define ZYGOTE_STACK_SIZE (64 * 1024)
+
+enum slot_state {
+  SLOT_EMPTY,
+  SLOT_WARMING,
+  SLOT_READY,
+  SLOT_CLAIMED,
+  SLOT_EXIT,
+};
+
+// the futex words live in memory shared between processes, so no
+// FUTEX_PRIVATE_FLAG here
+static int futex(atomic_int *uaddr, int op, int val) {
+  return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+// inherited by the zygote and the sandboxes it clones
+static struct zygote_shared *zshared = NULL;
+static zygote_job_fn zjob = NULL;
+static char uid_map[32];
+
+static void sandbox_broken(void) {
+  atomic_store(&zshared->broken, 1);
+  futex(&zshared->nready, FUTEX_WAKE, INT_MAX);
+}
+
+// body of a warm sandbox, does the expensive namespace setup up front and
+// then parks until zygote_run hands it a job
+static int sandbox_main(void *args) {
+  struct zygote_slot *slot = args;
+  int fd = open("/proc/self/uid_map", O_RDWR);
+  if (fd < 0 || write(fd, uid_map, strlen(uid_map)) < 0 || setuid(0) == -1) {
+    sandbox_broken();
+    return 1;
+  }
+  close(fd);
+
+  // zygote_stop may already want us gone
+  int expected = SLOT_WARMING;
+  if (!atomic_compare_exchange_strong(&slot->state, &expected, SLOT_READY)) {
+    return 0;
+  }
+  atomic_fetch_add(&zshared->nready, 1);
+  futex(&zshared->nready, FUTEX_WAKE, 1);
+
+  int state;
+  while ((state = atomic_load(&slot->state)) == SLOT_READY) {
+    futex(&slot->state, FUTEX_WAIT, SLOT_READY);
+  }
+  if (state == SLOT_EXIT) {
+    return 0;
+  }
+  uint64_t arg = slot->arg;
+
+  // done with the slot, let the zygote warm up the next sandbox in it
+  atomic_store(&slot->state, SLOT_EMPTY);
+  atomic_fetch_add(&zshared->refill, 1);
+  futex(&zshared->refill, FUTEX_WAKE, 1);
+  return zjob(arg);
+}
+
+static void zygote_main(void) {
+  void *stack = stack_alloc(ZYGOTE_STACK_SIZE);
+  if (!stack) {
+    sandbox_broken();
+    _exit(1);
+  }
+  while (!atomic_load(&zshared->stop)) {
+    int refill = atomic_load(&zshared->refill);
+    for (unsigned i = 0; i < zshared->nslots; ++i) {
+      struct zygote_slot *slot = &zshared->slots[i];
+      if (atomic_load(&slot->state) != SLOT_EMPTY) {
+        continue;
+      }
+      atomic_store(&slot->state, SLOT_WARMING);
+      // sandboxes get a copy of our memory, so one stack serves them all.
+      // The kernel stores the pid in the shared slot before the sandbox runs.
+      int flags = CLONE_NEWUSER | CLONE_PARENT | CLONE_PARENT_SETTID;
+      pid_t pid = clone(sandbox_main, (uint8_t *)stack + ZYGOTE_STACK_SIZE, flags | SIGCHLD,
+                        slot, &slot->pid);
+      if (pid == -1) {
+        fprintf(stderr, "zygote: clone failed with errno %d\n", errno);
+        sandbox_broken();
+        _exit(1);
+      }
+    }
+    futex(&zshared->refill, FUTEX_WAIT, refill);
+  }
+  _exit(0);
+}
+
+int zygote_start(struct zygote *z, unsigned nslots, zygote_job_fn job) {
+  z->len = sizeof(struct zygote_shared) + nslots * sizeof(struct zygote_slot);
+  z->shared = mmap(NULL, z->len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (z->shared == MAP_FAILED) {
+    fprintf(stderr, "mmap of zygote slots failed with errno %d\n", errno);
+    return -1;
+  }
+  z->shared->nslots = nslots;
+  for (unsigned i = 0; i < nslots; ++i) {
+    atomic_init(&z->shared->slots[i].state, SLOT_EMPTY);
+  }
+  zshared = z->shared;
+  zjob = job;
+  snprintf(uid_map, sizeof(uid_map), "0 %d 1\n", getuid());
+
+  fflush(stdout);
+  z->pid = fork();
+  if (z->pid == -1) {
+    fprintf(stderr, "fork of zygote failed with errno %d\n", errno);
+    munmap(z->shared, z->len);
+    return -1;
+  }
+  if (z->pid == 0) {
+    zygote_main();
+  }
+  return 0;
+}
+
+pid_t zygote_run(struct zygote *z, uint64_t arg) {
+  struct zygote_shared *zs = z->shared;
+  while (true) {
+    if (atomic_load(&zs->broken)) {
+      return -1;
+    }
+    int nready = atomic_load(&zs->nready);
+    if (nready == 0) {
+      futex(&zs->nready, FUTEX_WAIT, 0);
+      continue;
+    }
+    for (unsigned i = 0; i < zs->nslots; ++i) {
+      struct zygote_slot *slot = &zs->slots[i];
+      if (atomic_load(&slot->state) != SLOT_READY) {
+        continue;
+      }
+      atomic_fetch_sub(&zs->nready, 1);
+      slot->arg = arg;
+      pid_t pid = slot->pid;
+      atomic_store(&slot->state, SLOT_CLAIMED);
+      futex(&slot->state, FUTEX_WAKE, 1);
+      return pid;
+    }
+  }
+}
+
+void zygote_stop(struct zygote *z) {
+  struct zygote_shared *zs = z->shared;
+  atomic_store(&zs->stop, 1);
+  atomic_fetch_add(&zs->refill, 1);
+  futex(&zs->refill, FUTEX_WAKE, 1);
+  if (waitpid(z->pid, NULL, 0) == -1) {
+    fprintf(stderr, "waitpid on zygote failed with errno %d\n", errno);
+  }
+
+  // the zygote is gone, whatever it started warming up is ours to reap
+  for (unsigned i = 0; i < zs->nslots; ++i) {
+    struct zygote_slot *slot = &zs->slots[i];
+    int state = atomic_load(&slot->state);
+    if (state != SLOT_WARMING && state != SLOT_READY) {
+      continue;
+    }
+    // a sandbox that is still warming up sees this and exits instead of parking
+    atomic_store(&slot->state, SLOT_EXIT);
+    futex(&slot->state, FUTEX_WAKE, 1);
+    waitpid(slot->pid, NULL, 0);
+  }
+  munmap(zs, z->len);
+}
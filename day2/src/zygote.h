@@ -0,0 +1,49 @@
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+// runs inside a sandbox as root of its own user namespace, the return value
+// becomes the sandbox's exit code
+typedef int (*zygote_job_fn)(uint64_t arg);
+
+struct zygote_slot {
+  atomic_int state;   // futex word the warm sandbox parks on
+  pid_t pid;
+  uint64_t arg;
+};
+
+// lives in MAP_SHARED memory, shared by the caller, the zygote process and
+// all sandboxes
+struct zygote_shared {
+  atomic_int nready;  // futex word, number of parked sandboxes
+  atomic_int refill;  // futex word, bumped whenever a slot becomes empty
+  atomic_int stop;
+  atomic_int broken;  // set if a sandbox could not set up its namespace
+  unsigned nslots;
+  struct zygote_slot slots[];
+};
+
+struct zygote {
+  pid_t pid;
+  size_t len;
+  struct zygote_shared *shared;
+};
+
+// forks a zygote process that keeps nslots sandboxes warm: each one is
+// cloned with CLONE_NEWUSER, has its uid_map written and became uid 0 in its
+// namespace before it parks. Sandboxes are cloned with CLONE_PARENT, so they
+// are children of the caller and can be waited for as usual.
+// Only one zygote per process.
+int zygote_start(struct zygote *z, unsigned nslots, zygote_job_fn job);
+
+// hands job(arg) to a warm sandbox, blocking until one is ready, and returns
+// its pid or -1 if sandboxes can not be created here
+pid_t zygote_run(struct zygote *z, uint64_t arg);
+
+// stops the zygote and lets all parked sandboxes exit
+void zygote_stop(struct zygote *z);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,9 +6,16 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <time.h>
+
+#include "palloc.h"
+#include "phash.h"
+#include "pstat.h"
+#include "ptx.h"
 
 // section(..) pushes variables in a seperate named ELF section
 #define persistent __attribute__((section("persistent")))
@@ -18,17 +26,40 @@
 
 // .section persistent
 page_aligned persistent int pstart;
-persistent unsigned int counter = 0;
+persistent _Atomic unsigned int counter = 0;
+persistent struct pheap heap;
+persistent struct ptx_log txlog;
+persistent struct phash kv;
+persistent struct pstat stats;
 page_aligned persistent int pend;
 
+// counters in the stats block
+enum {
+  STAT_RUNS,
+  STAT_BUMPS,
+};
+
 int setup_persistent(const char *fname) {
   int rc = 0;
-  int fd = open(fname, O_RDWR);
+  // the linker aligns the section to PAGE_SIZE, MAP_FIXED needs the real one
+  long pgsize = sysconf(_SC_PAGE_SIZE);
+  if ((uintptr_t)&pstart % pgsize != 0) {
+    fprintf(stderr, "persistent section is not aligned to the %ld byte page size\n", pgsize);
+    return -1;
+  }
+  int fd = open(fname, O_RDWR | O_CREAT, 0644);
   if (fd < 0) {
     fprintf(stderr, "failed to open file %s with errno %d\n", fname, errno);
     return -1;
   }
-  void *addr = mmap(&pstart, &pend - &pstart, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_SHARED, fd, 0);
+  size_t len = (char *)&pend - (char *)&pstart;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || ((uint64_t)st.st_size < len && ftruncate(fd, len) == -1)) {
+    fprintf(stderr, "failed to size file %s with errno %d\n", fname, errno);
+    rc = -1;
+    goto exit;
+  }
+  void *addr = mmap(&pstart, len, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_SHARED, fd, 0);
   if (addr == MAP_FAILED) {
     fprintf(stderr, "mmap failed with errno %d\n", errno);
     rc = -1;
@@ -47,13 +78,405 @@ exit:
   return rc;
 }
 
+// singly linked list of strings on the persistent heap, heap.root points to
+// the most recently pushed node
+struct pnode {
+  poff_t next;
+  char str[];
+};
+
+static int list_push(const char *str) {
+  struct pnode *node = palloc(sizeof(struct pnode) + strlen(str) + 1);
+  if (!node) {
+    return 1;
+  }
+  strcpy(node->str, str);
+  node->next = heap.root;
+  if (ptx_add(&heap.root, sizeof(heap.root)) == -1) {
+    return 1;
+  }
+  heap.root = poff(node);
+  return 0;
+}
+
+static int list_pop(void) {
+  struct pnode *node = pptr(heap.root);
+  if (!node) {
+    fprintf(stderr, "list is empty\n");
+    return 1;
+  }
+  printf("%s\n", node->str);
+  if (ptx_add(&heap.root, sizeof(heap.root)) == -1) {
+    return 1;
+  }
+  heap.root = node->next;
+  pfree(node);
+  return 0;
+}
+
+static void list_print(void) {
+  for (struct pnode *node = pptr(heap.root); node; node = pptr(node->next)) {
+    printf("%s\n", node->str);
+  }
+}
+
+// runs fn(arg) as one transaction
+static int run_tx(int (*fn)(const char *), const char *arg) {
+  if (ptx_begin() == -1) {
+    return 1;
+  }
+  if (fn(arg) != 0) {
+    ptx_abort();
+    return 1;
+  }
+  return ptx_commit() == -1;
+}
+
+// bumps the counter in n transactions, committing durably every group-th
+static int tx_count(unsigned n, unsigned group) {
+  ptx_set_group(group);
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (unsigned i = 0; i < n; ++i) {
+    if (ptx_begin() == -1 || ptx_add(&counter, sizeof(counter)) == -1) {
+      return 1;
+    }
+    counter++;
+    if (ptx_commit() == -1) {
+      return 1;
+    }
+  }
+  if (ptx_flush() == -1) {
+    return 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+  printf("count = %d, %u transactions in groups of %u, %.2f us each\n", counter, n, group, us / n);
+  return 0;
+}
+
+// modifies the counter and the list and dies before committing, the next
+// run rolls both back
+static int tx_crash(void) {
+  // leave a free block of the size the pushed node needs, so that the
+  // crashing transaction also overwrites a free list link
+  if (ptx_begin() == -1) {
+    return 1;
+  }
+  pfree(palloc(sizeof(struct pnode) + sizeof("uncommitted")));
+  if (ptx_commit() == -1) {
+    return 1;
+  }
+  if (ptx_begin() == -1 || ptx_add(&counter, sizeof(counter)) == -1) {
+    return 1;
+  }
+  counter += 1000;
+  list_push("uncommitted");
+  printf("crashing with count = %d\n", counter);
+  fflush(stdout);
+  _exit(1);
+}
+
+static struct timespec t_start;
+
+static double us_since(const struct timespec *t0) {
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (t1.tv_sec - t0->tv_sec) * 1e6 + (t1.tv_nsec - t0->tv_nsec) / 1e3;
+}
+
+// deterministic values so that both indexes can be checked against each other
+static uint64_t kv_value(uint64_t key) {
+  return key * 31 + 7;
+}
+
+// fills the persistent table with keys 1..n and writes the same pairs to a
+// flat file the volatile index is rebuilt from. The load isn't logged, it
+// holds the log lock instead so that no other process's transaction runs
+// while the table and the heap change under it.
+static int kv_load(uint64_t n, const char *fname) {
+  if (ptx_lock() == -1) {
+    return 1;
+  }
+  if (phash_init(&kv, n) == -1) {
+    ptx_unlock();
+    return 1;
+  }
+  FILE *f = fopen(fname, "w");
+  if (!f) {
+    fprintf(stderr, "failed to open file %s with errno %d\n", fname, errno);
+    ptx_unlock();
+    return 1;
+  }
+  struct timespec t0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  int rc = 0;
+  for (uint64_t key = 1; key <= n; ++key) {
+    struct phash_bucket b = { key, kv_value(key) };
+    if (phash_put(&kv, b.key, b.val) == -1 || fwrite(&b, sizeof(b), 1, f) != 1) {
+      rc = 1;
+      break;
+    }
+  }
+  if (fclose(f) != 0) {
+    rc = 1;
+  }
+  printf("loaded %lu keys in %.0f us, %lu in table (cap %lu)\n", n, us_since(&t0),
+         phash_count(&kv), kv.cap);
+  rc = rc || pheap_sync() == -1;
+  ptx_unlock();
+  return rc;
+}
+
+// random lookups of keys 1..n, every fourth one misses
+static void kv_lookup_keys(uint64_t *keys, size_t nkeys, uint64_t n) {
+  uint64_t x = 88172645463325252ull;
+  for (size_t i = 0; i < nkeys; ++i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    keys[i] = x % (n + n / 3) + 1;
+  }
+}
+
+// compares the persistent table, usable as soon as the file is mapped, with
+// an index rebuilt from the flat file on every start
+static int kv_bench(const char *fname) {
+  double ready_us = us_since(&t_start);
+  uint64_t n = phash_count(&kv);
+  if (kv.magic == 0 || n == 0) {
+    fprintf(stderr, "persistent table is empty, run kvload first\n");
+    return 1;
+  }
+  size_t nkeys = 1 << 22;
+  uint64_t *keys = malloc(nkeys * sizeof(*keys));
+  if (!keys) {
+    return 1;
+  }
+  kv_lookup_keys(keys, nkeys, n);
+
+  struct timespec t0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  uint64_t hits = 0, sum = 0, val;
+  for (size_t i = 0; i < nkeys; ++i) {
+    if (phash_get(&kv, keys[i], &val)) {
+      hits++;
+      sum += val;
+    }
+  }
+  double lookup_us = us_since(&t0);
+  printf("persistent: ready %.0f us after start, %lu lookups in %.0f us (%.1f M/s), %lu hits\n",
+         ready_us, nkeys, lookup_us, nkeys / lookup_us, hits);
+
+  // rebuild from the flat file
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  FILE *f = fopen(fname, "r");
+  if (!f) {
+    fprintf(stderr, "failed to open file %s with errno %d\n", fname, errno);
+    free(keys);
+    return 1;
+  }
+  uint64_t cap = 16;
+  while (cap * 5 < n * 10) {
+    cap <<= 1;
+  }
+  struct phash_bucket *table = calloc(cap, sizeof(*table));
+  struct phash_bucket buf[4096];
+  size_t nread;
+  while (table && (nread = fread(buf, sizeof(*buf), 4096, f)) > 0) {
+    for (size_t i = 0; i < nread; ++i) {
+      *phash_slot(table, cap, buf[i].key) = buf[i];
+    }
+  }
+  fclose(f);
+  if (!table) {
+    free(keys);
+    return 1;
+  }
+  double rebuild_us = us_since(&t0);
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  uint64_t vhits = 0, vsum = 0;
+  for (size_t i = 0; i < nkeys; ++i) {
+    struct phash_bucket *b = phash_find(table, cap, keys[i]);
+    if (b) {
+      vhits++;
+      vsum += b->val;
+    }
+  }
+  lookup_us = us_since(&t0);
+  printf("flat file:  ready %.0f us after start, %lu lookups in %.0f us (%.1f M/s), %lu hits\n",
+         ready_us + rebuild_us, nkeys, lookup_us, nkeys / lookup_us, vhits);
+  free(table);
+  free(keys);
+  if (hits != vhits || sum != vsum) {
+    fprintf(stderr, "persistent and rebuilt index disagree\n");
+    return 1;
+  }
+  return 0;
+}
+
+// nprocs processes bump a counter n times each, once all on the single
+// shared counter and once on their per-CPU stats slots
+static int stat_bench(unsigned nprocs, unsigned n) {
+  for (int mode = 0; mode < 2; ++mode) {
+    unsigned before = counter;
+    uint64_t before_stat = pstat_read(&stats, STAT_BUMPS);
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (unsigned p = 0; p < nprocs; ++p) {
+      pid_t pid = fork();
+      if (pid == -1) {
+        fprintf(stderr, "fork failed with errno %d\n", errno);
+        return 1;
+      }
+      if (pid == 0) {
+        for (unsigned i = 0; i < n; ++i) {
+          if (mode == 0) {
+            counter++;
+          } else {
+            pstat_add(&stats, STAT_BUMPS, 1);
+          }
+        }
+        _exit(0);
+      }
+    }
+    while (wait(NULL) > 0)
+      ;
+    double us = us_since(&t0);
+    uint64_t total = mode == 0 ? counter - before : pstat_read(&stats, STAT_BUMPS) - before_stat;
+    printf("%-14s %u procs x %u: %lu bumps (%s), %.2f ns each\n",
+           mode == 0 ? "shared counter" : "per-CPU slots", nprocs, n, total,
+           total == (uint64_t)nprocs * n ? "none lost" : "LOST UPDATES", us * 1e3 / ((double)nprocs * n));
+  }
+  return 0;
+}
+
+// size with an optional k, m or g suffix, 0 if invalid
+static uint64_t parse_size(const char *str) {
+  char *end = NULL;
+  errno = 0;
+  unsigned long long val = strtoull(str, &end, 10);
+  if (errno != 0 || end == str) {
+    return 0;
+  }
+  switch (*end) {
+    case 'k': case 'K':
+      val <<= 10;
+      end++;
+      break;
+    case 'm': case 'M':
+      val <<= 20;
+      end++;
+      break;
+    case 'g': case 'G':
+      val <<= 30;
+      end++;
+      break;
+    default:
+      break;
+  }
+  return *end == '\0' ? val : 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [-f FILE] [-s SIZE] [-H] [MODE ARGS...]\n", prog);
+  fprintf(stderr, "  -f FILE  persistent file, default mmap.persistent\n");
+  fprintf(stderr, "  -s SIZE  grow the persistent heap to at least SIZE bytes\n");
+  fprintf(stderr, "  -H       back the heap with huge pages where the file system allows it\n");
+}
+
 int main(int argc, char **argv) {
-  if (setup_persistent("mmap.persistent") == -1) {
+  clock_gettime(CLOCK_MONOTONIC, &t_start);
+  const char *fname = "mmap.persistent";
+  uint64_t heap_size = 0;
+  int heap_flags = 0;
+  int opt;
+  // '+' stops at the mode, its arguments are not options
+  while ((opt = getopt(argc, argv, "+f:s:H")) != -1) {
+    switch (opt) {
+      case 'f':
+        fname = optarg;
+        break;
+      case 's':
+        heap_size = parse_size(optarg);
+        if (heap_size == 0) {
+          fprintf(stderr, "invalid heap size %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'H':
+        heap_flags |= PHEAP_HUGE;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  // the mode becomes argv[1] again
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if (setup_persistent(fname) == -1) {
     fprintf(stderr, "setup_persistent failed\n");
     return 1;
   }
-  printf("persistent %p - %p\n", &pstart, &pend);
-  printf("counter addr: %p\n", &counter);
-  printf("count = %d\n", counter++);
-  return 0;
+
+  // the heap data follows the persistent section in the same file
+  size_t section_len = (char *)&pend - (char *)&pstart;
+  if (pheap_open(&heap, fname, section_len, heap_size, heap_flags) == -1) {
+    fprintf(stderr, "pheap_open failed\n");
+    return 1;
+  }
+  int nundone = ptx_init(&txlog, &pstart, section_len, fname);
+  if (nundone == -1) {
+    fprintf(stderr, "ptx_init failed\n");
+    return 1;
+  }
+  if (nundone > 0) {
+    printf("recovery: rolled back %d log entries of an interrupted transaction\n", nundone);
+    if (pheap_check() == -1) {
+      fprintf(stderr, "recovery left the heap free lists broken\n");
+      return 1;
+    }
+  }
+
+  pstat_add(&stats, STAT_RUNS, 1);
+
+  int rc = 0;
+  if (argc < 2) {
+    printf("persistent %p - %p\n", &pstart, &pend);
+    printf("counter addr: %p\n", &counter);
+    printf("count = %d\n", counter++);
+    printf("runs = %lu, bumps = %lu\n", pstat_read(&stats, STAT_RUNS), pstat_read(&stats, STAT_BUMPS));
+  } else if (strncmp(argv[1], "push", 5) == 0 && argc > 2) {
+    rc = list_push(argv[2]);
+  } else if (strncmp(argv[1], "txpush", 7) == 0 && argc > 2) {
+    rc = run_tx(list_push, argv[2]);
+  } else if (strncmp(argv[1], "txcount", 8) == 0) {
+    unsigned n = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000;
+    unsigned group = argc > 3 ? strtoul(argv[3], NULL, 10) : 1;
+    rc = tx_count(n, group);
+  } else if (strncmp(argv[1], "crash", 6) == 0) {
+    rc = tx_crash();
+  } else if (strncmp(argv[1], "pop", 4) == 0) {
+    rc = list_pop();
+  } else if (strncmp(argv[1], "list", 5) == 0) {
+    list_print();
+  } else if (strncmp(argv[1], "heapinfo", 9) == 0) {
+    printf("heap: %zu bytes mapped, %lu in use, %ld backed by huge pages\n",
+           pheap_mapped_size(), heap.brk, pheap_huge_bytes());
+  } else if (strncmp(argv[1], "stat", 5) == 0) {
+    unsigned nprocs = argc > 2 ? strtoul(argv[2], NULL, 10) : 4;
+    unsigned n = argc > 3 ? strtoul(argv[3], NULL, 10) : 1000000;
+    rc = stat_bench(nprocs, n);
+  } else if (strncmp(argv[1], "kvload", 7) == 0 && argc > 2) {
+    rc = kv_load(strtoull(argv[2], NULL, 10), argc > 3 ? argv[3] : "kv.flat");
+  } else if (strncmp(argv[1], "kvbench", 8) == 0) {
+    rc = kv_bench(argc > 2 ? argv[2] : "kv.flat");
+  } else {
+    rc = 1;
+  }
+  pheap_close();
+  return rc;
 }
@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include "palloc.h"
+#include "ptx.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// bumped whenever the block layout changes, older heaps are reinitialized
+#define PHEAP_MAGIC 0x3270616568703164ull
+
+// address space reserved up front, the heap is grown inside it so that it
+// never has to move while the process runs
+#define PHEAP_RESERVE (64ull << 30)
+
+#define PHEAP_MIN_GROW (1ull << 20)
+
+#define BLOCK_ALLOCATED 0xa110ca7e
+#define BLOCK_FREE 0xf4eef4ee
+
+// precedes every block. Free lists link payload offsets, a free block keeps
+// the offset of the next free payload of its class in its first bytes.
+struct pblock {
+  uint32_t cls;
+  uint32_t tag;
+  uint64_t reserved;
+};
+
+static struct {
+  struct pheap *heap;
+  uint8_t *base;
+  uint8_t *reserve;   // start of the reserved range, base lies within it
+  uint64_t mapped;    // bytes of heap data mapped by this process
+  int fd;
+  off_t data_off;
+  bool huge;
+} ph = { .fd = -1 };
+
+static size_t page_size(void) {
+  return sysconf(_SC_PAGE_SIZE);
+}
+
+// maps [from, to) of the heap data, the file must already be large enough
+static int pheap_map(uint64_t from, uint64_t to) {
+  if (to <= from) {
+    return 0;
+  }
+  void *addr = mmap(ph.base + from, to - from, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                    ph.fd, ph.data_off + from);
+  if (addr == MAP_FAILED) {
+    fprintf(stderr, "mmap of heap range %lu - %lu failed with errno %d\n", from, to, errno);
+    return -1;
+  }
+  if (ph.huge && madvise(addr, to - from, MADV_HUGEPAGE) == -1) {
+    // kernel without THP support, keep going with small pages
+    fprintf(stderr, "madvise(MADV_HUGEPAGE) failed with errno %d, using 4K pages\n", errno);
+    ph.huge = false;
+  }
+  return 0;
+}
+
+// heap->size is shared, another process may have grown the file since
+int pheap_remap(void) {
+  uint64_t size = ph.heap->size;
+  if (size <= ph.mapped) {
+    return 0;
+  }
+  if (pheap_map(ph.mapped, size) == -1) {
+    return -1;
+  }
+  ph.mapped = size;
+  return 0;
+}
+
+static int pheap_grow(uint64_t need) {
+  struct pheap *heap = ph.heap;
+  uint64_t size = heap->size * 2;
+  if (size < need) {
+    size = need;
+  }
+  if (size < PHEAP_MIN_GROW) {
+    size = PHEAP_MIN_GROW;
+  }
+  size = (size + page_size() - 1) & ~(page_size() - 1);
+  if (ph.huge && size >= PHEAP_HUGE_MIN) {
+    // end the file on a huge page boundary so the last huge page is whole
+    uint64_t end = (ph.data_off + size + PHEAP_HUGE_PAGE - 1) & ~(PHEAP_HUGE_PAGE - 1);
+    size = end - ph.data_off;
+  }
+  if (size > PHEAP_RESERVE) {
+    fprintf(stderr, "persistent heap exhausted\n");
+    return -1;
+  }
+  if (ptx_add(&heap->size, sizeof(heap->size)) == -1) {
+    return -1;
+  }
+  // a rolled back growth leaves the file larger than the heap, other
+  // processes may still have that part mapped
+  struct stat st;
+  if (fstat(ph.fd, &st) == -1) {
+    fprintf(stderr, "fstat of heap file failed with errno %d\n", errno);
+    return -1;
+  }
+  if ((uint64_t)st.st_size < ph.data_off + size && ftruncate(ph.fd, ph.data_off + size) == -1) {
+    fprintf(stderr, "ftruncate to %lu bytes failed with errno %d\n", ph.data_off + size, errno);
+    return -1;
+  }
+  if (size > ph.mapped) {
+    if (pheap_map(ph.mapped, size) == -1) {
+      return -1;
+    }
+    ph.mapped = size;
+  }
+  heap->size = size;
+  return 0;
+}
+
+int pheap_open(struct pheap *heap, const char *fname, off_t data_off, uint64_t min_size, int flags) {
+  ph.fd = open(fname, O_RDWR);
+  if (ph.fd < 0) {
+    fprintf(stderr, "failed to open file %s with errno %d\n", fname, errno);
+    return -1;
+  }
+  ph.reserve = mmap(NULL, PHEAP_RESERVE + 2 * PHEAP_HUGE_PAGE, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (ph.reserve == MAP_FAILED) {
+    fprintf(stderr, "failed to reserve heap address space, errno %d\n", errno);
+    ph.reserve = NULL;
+    goto fail;
+  }
+  // a file page can only be mapped huge if its virtual address has the same
+  // offset into a huge page as its file offset
+  uintptr_t base = ((uintptr_t)ph.reserve + PHEAP_HUGE_PAGE - 1) & ~(PHEAP_HUGE_PAGE - 1);
+  ph.base = (uint8_t *)base + data_off % PHEAP_HUGE_PAGE;
+  ph.heap = heap;
+  ph.data_off = data_off;
+  ph.huge = flags & PHEAP_HUGE;
+  ph.mapped = 0;
+
+  // other processes may be setting up or growing the heap right now. ptx
+  // isn't up yet, so hold the same flock through ph.fd until we are done.
+  while (flock(ph.fd, LOCK_EX) == -1) {
+    if (errno != EINTR) {
+      fprintf(stderr, "flock of %s failed with errno %d\n", fname, errno);
+      goto fail;
+    }
+  }
+  if (heap->magic != PHEAP_MAGIC) {
+    memset(heap, 0, sizeof(*heap));
+    heap->magic = PHEAP_MAGIC;
+    if (min_size > 0 && pheap_grow(min_size) == -1) {
+      goto fail;
+    }
+    flock(ph.fd, LOCK_UN);
+    return 0;
+  }
+  struct stat st;
+  if (fstat(ph.fd, &st) == -1 || (uint64_t)st.st_size < data_off + heap->size) {
+    fprintf(stderr, "%s is smaller than its persistent heap\n", fname);
+    goto fail;
+  }
+  if (pheap_remap() == -1) {
+    goto fail;
+  }
+  if (heap->size < min_size && pheap_grow(min_size) == -1) {
+    goto fail;
+  }
+  flock(ph.fd, LOCK_UN);
+  return 0;
+
+fail:
+  pheap_close();
+  return -1;
+}
+
+size_t pheap_mapped_size(void) {
+  return ph.heap ? ph.mapped : 0;
+}
+
+int pheap_sync(void) {
+  if (ph.mapped > 0 && msync(ph.base, ph.mapped, MS_SYNC) == -1) {
+    fprintf(stderr, "msync of heap failed with errno %d\n", errno);
+    return -1;
+  }
+  return 0;
+}
+
+long pheap_huge_bytes(void) {
+  FILE *f = fopen("/proc/self/smaps", "r");
+  if (!f) {
+    return -1;
+  }
+  uintptr_t lo = (uintptr_t)ph.base;
+  uintptr_t hi = lo + pheap_mapped_size();
+  bool in_heap = false;
+  long kb = 0, total = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    uintptr_t start, end;
+    if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+      in_heap = start < hi && end > lo;
+    } else if (in_heap && (sscanf(line, "FilePmdMapped: %ld kB", &kb) == 1
+                           || sscanf(line, "ShmemPmdMapped: %ld kB", &kb) == 1)) {
+      total += kb;
+    }
+  }
+  fclose(f);
+  return total * 1024;
+}
+
+void pheap_close(void) {
+  if (ph.reserve) {
+    munmap(ph.reserve, PHEAP_RESERVE + 2 * PHEAP_HUGE_PAGE);
+  }
+  if (ph.fd >= 0) {
+    close(ph.fd);
+  }
+  ph.base = NULL;
+  ph.reserve = NULL;
+  ph.heap = NULL;
+  ph.mapped = 0;
+  ph.fd = -1;
+}
+
+// smallest class whose payload holds size bytes. Classes are sized on the
+// payload, a block is its header plus a power of two, so power of two
+// requests like hash tables fit their class exactly.
+// PHEAP_NCLASSES if even the largest class is too small.
+static int size_class(size_t size) {
+  int cls = 0;
+  while (cls < PHEAP_NCLASSES && ((size_t)1 << (cls + PHEAP_MIN_SHIFT)) < size) {
+    cls++;
+  }
+  return cls;
+}
+
+static void *heap_alloc(size_t size) {
+  struct pheap *heap = ph.heap;
+  int cls = size_class(size);
+  if (cls >= PHEAP_NCLASSES) {
+    fprintf(stderr, "palloc of %zu bytes exceeds the largest size class\n", size);
+    return NULL;
+  }
+
+  struct pblock *blk;
+  if (heap->free_lists[cls] != POFF_NULL) {
+    blk = (struct pblock *)pptr(heap->free_lists[cls]) - 1;
+    // the link word is overwritten by the caller, a rollback has to bring it
+    // back together with the list head
+    if (ptx_add(&heap->free_lists[cls], sizeof(poff_t)) == -1
+        || ptx_add(blk, sizeof(*blk) + sizeof(poff_t)) == -1) {
+      return NULL;
+    }
+    heap->free_lists[cls] = *(poff_t *)(blk + 1);
+  } else {
+    uint64_t bsize = sizeof(struct pblock) + ((uint64_t)1 << (cls + PHEAP_MIN_SHIFT));
+    if (heap->brk + bsize > heap->size && pheap_grow(heap->brk + bsize) == -1) {
+      return NULL;
+    }
+    blk = (struct pblock *)(ph.base + heap->brk);
+    if (ptx_add(&heap->brk, sizeof(heap->brk)) == -1 || ptx_add(blk, sizeof(*blk)) == -1) {
+      return NULL;
+    }
+    heap->brk += bsize;
+  }
+  blk->cls = cls;
+  blk->tag = BLOCK_ALLOCATED;
+  return blk + 1;
+}
+
+void *palloc(size_t size) {
+  // outside a transaction nothing is logged, but the heap metadata is still
+  // shared with the transactions of other processes
+  if (ptx_lock() == -1) {
+    return NULL;
+  }
+  void *p = heap_alloc(size);
+  ptx_unlock();
+  return p;
+}
+
+void *pzalloc(size_t size) {
+  uint8_t *p = palloc(size);
+  if (!p) {
+    return NULL;
+  }
+  // base and file offsets agree modulo the page size, so whole pages of the
+  // block are whole pages of the file
+  uintptr_t start = ((uintptr_t)p + page_size() - 1) & ~(page_size() - 1);
+  uintptr_t end = ((uintptr_t)p + size) & ~(page_size() - 1);
+  if (end > start) {
+    // punched pages read as zero without being touched, a block fresh from
+    // the file growth is a hole already and costs nothing
+    off_t off = ph.data_off + (start - (uintptr_t)ph.base);
+    if (fallocate(ph.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, end - start) == 0
+        && fdatasync(ph.fd) == 0) {
+      memset(p, 0, start - (uintptr_t)p);
+      memset((void *)end, 0, (uintptr_t)p + size - end);
+      return p;
+    }
+  }
+  memset(p, 0, size);
+  return p;
+}
+
+static void heap_free(void *ptr) {
+  struct pblock *blk = (struct pblock *)ptr - 1;
+  if (blk->tag != BLOCK_ALLOCATED) {
+    fprintf(stderr, "pfree of invalid or already freed pointer %p\n", ptr);
+    abort();
+  }
+  if (ptx_add(blk, sizeof(*blk) + sizeof(poff_t)) == -1
+      || ptx_add(&ph.heap->free_lists[blk->cls], sizeof(poff_t)) == -1) {
+    fprintf(stderr, "pfree of %p could not be logged\n", ptr);
+    return;
+  }
+  blk->tag = BLOCK_FREE;
+  *(poff_t *)ptr = ph.heap->free_lists[blk->cls];
+  ph.heap->free_lists[blk->cls] = poff(ptr);
+}
+
+void pfree(void *ptr) {
+  if (!ptr) {
+    return;
+  }
+  if (ptx_lock() == -1) {
+    fprintf(stderr, "pfree of %p failed to take the heap lock\n", ptr);
+    return;
+  }
+  heap_free(ptr);
+  ptx_unlock();
+}
+
+int pheap_check(void) {
+  struct pheap *heap = ph.heap;
+  for (int cls = 0; cls < PHEAP_NCLASSES; ++cls) {
+    // a list can't hold more blocks than fit below brk, more means a cycle
+    uint64_t max = heap->brk >> (cls + PHEAP_MIN_SHIFT);
+    uint64_t n = 0;
+    for (poff_t off = heap->free_lists[cls]; off != POFF_NULL; off = *(poff_t *)pptr(off)) {
+      struct pblock *blk = (struct pblock *)pptr(off) - 1;
+      if (off < sizeof(*blk) || off > heap->brk || blk->tag != BLOCK_FREE || blk->cls != (uint32_t)cls
+          || ++n > max) {
+        fprintf(stderr, "free list of class %d is corrupt at offset %lu\n", cls, off);
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+poff_t poff(const void *ptr) {
+  return ptr ? (const uint8_t *)ptr - ph.base : POFF_NULL;
+}
+
+void *pptr(poff_t off) {
+  if (off == POFF_NULL) {
+    return NULL;
+  }
+  // a block handed out by another process may lie past our mapping. Its
+  // offset was published after the heap grew, so heap->size covers it.
+  if (ph.heap->size > ph.mapped && pheap_remap() == -1) {
+    abort();
+  }
+  return ph.base + off;
+}
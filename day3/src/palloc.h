@@ -0,0 +1,81 @@
+#ifndef PALLOC_H
+#define PALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// blocks are handed out in power of two size classes of their payload,
+// from 16 bytes up to 32 GiB
+#define PHEAP_MIN_SHIFT 4
+#define PHEAP_NCLASSES 32
+
+// persistent pointer, a byte offset into the heap. The heap is mapped at a
+// different address on every run, so only offsets may be stored in it.
+typedef uint64_t poff_t;
+#define POFF_NULL ((poff_t)0)
+
+// heap metadata, lives in the persistent section so that it is mapped
+// together with the other persistent variables
+struct pheap {
+  uint64_t magic;
+  uint64_t size;                        // bytes of heap data in the file
+  uint64_t brk;                         // first offset never handed out
+  poff_t free_lists[PHEAP_NCLASSES];
+  poff_t root;                          // entry point for the application
+};
+
+// size of the pages PHEAP_HUGE asks for
+#define PHEAP_HUGE_PAGE (2ull << 20)
+
+// heaps at least this large are grown in whole huge pages
+#define PHEAP_HUGE_MIN (8ull << 20)
+
+// pheap_open flags
+#define PHEAP_HUGE 0x1  // back the heap with transparent huge pages
+
+// maps the heap data that follows the persistent section in fname, starting
+// at file offset data_off, and initializes the heap on first use. The heap
+// is grown to at least min_size bytes right away.
+// With PHEAP_HUGE the mapping is laid out so that file and virtual addresses
+// agree modulo PHEAP_HUGE_PAGE and advised with MADV_HUGEPAGE. Whether the
+// kernel really uses huge pages depends on the file system (tmpfs with
+// huge=advise or within_size, or shmem_enabled), otherwise 4K pages are used.
+int pheap_open(struct pheap *heap, const char *fname, off_t data_off, uint64_t min_size, int flags);
+void pheap_close(void);
+
+// bytes of heap data currently mapped by this process
+size_t pheap_mapped_size(void);
+
+// maps whatever another process added to the heap since, must be called
+// under the log lock (see ptx.h) before touching the heap. pptr does it
+// for blocks past the mapping on its own.
+int pheap_remap(void);
+
+// bytes of the heap mapping currently backed by huge pages, read from
+// /proc/self/smaps. -1 if that can't be determined.
+long pheap_huge_bytes(void);
+
+// msyncs the whole heap
+int pheap_sync(void);
+
+// allocates size bytes from the persistent heap, growing the file if needed.
+// Both run under the log lock (see ptx.h), so processes sharing the file
+// don't update the heap metadata at the same time. Inside a transaction the
+// metadata changes are logged, so allocations and frees are rolled back
+// together with the transaction.
+void *palloc(size_t size);
+void pfree(void *ptr);
+
+// palloc that returns zeroed memory. Whole pages are zeroed by punching
+// them out of the file instead of writing them, so large blocks cost about
+// the same as small ones.
+void *pzalloc(size_t size);
+
+// walks all free lists, -1 if one of them is broken
+int pheap_check(void);
+
+poff_t poff(const void *ptr);
+void *pptr(poff_t off);
+
+#endif
@@ -0,0 +1,218 @@
+#include "phash.h"
+#include "ptx.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// tables live on the heap, a reinitialized heap means a new table
+#define PHASH_MAGIC 0x3268736168703164ull
+
+// resize once live and deleted buckets fill this many tenths of the table
+#define PHASH_MAX_LOAD 7
+
+uint64_t phash_hash(uint64_t key) {
+  // splitmix64 finalizer
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ull;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebull;
+  key ^= key >> 31;
+  return key;
+}
+
+struct phash_bucket *phash_find(struct phash_bucket *b, uint64_t cap, uint64_t key) {
+  uint64_t mask = cap - 1;
+  for (uint64_t i = phash_hash(key) & mask;; i = (i + 1) & mask) {
+    if (b[i].key == key) {
+      return &b[i];
+    }
+    if (b[i].key == PHASH_EMPTY) {
+      return NULL;
+    }
+  }
+}
+
+struct phash_bucket *phash_slot(struct phash_bucket *b, uint64_t cap, uint64_t key) {
+  uint64_t mask = cap - 1;
+  struct phash_bucket *tomb = NULL;
+  for (uint64_t i = phash_hash(key) & mask;; i = (i + 1) & mask) {
+    if (b[i].key == key) {
+      return &b[i];
+    }
+    if (b[i].key == PHASH_TOMB && !tomb) {
+      tomb = &b[i];
+    }
+    if (b[i].key == PHASH_EMPTY) {
+      return tomb ? tomb : &b[i];
+    }
+  }
+}
+
+// no memset of the whole table, that would make every resize a pause
+// proportional to the new size
+static struct phash_bucket *table_alloc(uint64_t cap) {
+  return pzalloc(cap * sizeof(struct phash_bucket));
+}
+
+int phash_init(struct phash *h, uint64_t cap) {
+  if (h->magic == PHASH_MAGIC) {
+    return 0;
+  }
+  uint64_t pow2 = 16;
+  while (pow2 < cap) {
+    pow2 <<= 1;
+  }
+  struct phash_bucket *b = table_alloc(pow2);
+  if (!b) {
+    return -1;
+  }
+  if (ptx_add(h, sizeof(*h)) == -1) {
+    return -1;
+  }
+  memset(h, 0, sizeof(*h));
+  h->table = poff(b);
+  h->cap = pow2;
+  h->magic = PHASH_MAGIC;
+  return 0;
+}
+
+uint64_t phash_count(const struct phash *h) {
+  return h->count;
+}
+
+// moves up to n buckets of the old table, frees it once it is drained
+static int migrate(struct phash *h, uint64_t n) {
+  struct phash_bucket *old = pptr(h->old);
+  struct phash_bucket *b = pptr(h->table);
+  for (; n > 0 && h->migrated < h->old_cap; --n, h->migrated++) {
+    struct phash_bucket *ob = &old[h->migrated];
+    if (ob->key == PHASH_EMPTY || ob->key == PHASH_TOMB) {
+      continue;
+    }
+    struct phash_bucket *s = phash_slot(b, h->cap, ob->key);
+    if (ptx_add(s, sizeof(*s)) == -1 || ptx_add(ob, sizeof(*ob)) == -1) {
+      return -1;
+    }
+    if (s->key == PHASH_EMPTY) {
+      h->used++;
+    }
+    *s = *ob;
+    // lookups fall back to the old table, don't let them find stale copies
+    ob->key = PHASH_TOMB;
+  }
+  if (h->migrated == h->old_cap) {
+    pfree(old);
+    h->old = POFF_NULL;
+    h->old_cap = 0;
+    h->migrated = 0;
+  }
+  return 0;
+}
+
+static int resize_start(struct phash *h) {
+  // only happens if the new table fills up before the old one is drained
+  if (h->old != POFF_NULL && migrate(h, h->old_cap) == -1) {
+    return -1;
+  }
+  uint64_t cap = h->cap;
+  while ((h->count + 1) * 10 > cap * 5) {
+    cap <<= 1;
+  }
+  struct phash_bucket *b = table_alloc(cap);
+  if (!b) {
+    return -1;
+  }
+  h->old = h->table;
+  h->old_cap = h->cap;
+  h->migrated = 0;
+  h->table = poff(b);
+  h->cap = cap;
+  h->used = 0;
+  return 0;
+}
+
+bool phash_get(struct phash *h, uint64_t key, uint64_t *val) {
+  // reserved keys would match empty or deleted buckets
+  if (key == PHASH_EMPTY || key == PHASH_TOMB) {
+    return false;
+  }
+  struct phash_bucket *f = phash_find(pptr(h->table), h->cap, key);
+  if (!f && h->old != POFF_NULL) {
+    f = phash_find(pptr(h->old), h->old_cap, key);
+  }
+  if (!f) {
+    return false;
+  }
+  *val = f->val;
+  return true;
+}
+
+int phash_put(struct phash *h, uint64_t key, uint64_t val) {
+  if (key == PHASH_EMPTY || key == PHASH_TOMB) {
+    fprintf(stderr, "phash_put: key %lu is reserved\n", key);
+    return -1;
+  }
+  if (ptx_add(h, sizeof(*h)) == -1) {
+    return -1;
+  }
+  if (h->old != POFF_NULL && migrate(h, PHASH_MIGRATE_STEP) == -1) {
+    return -1;
+  }
+
+  struct phash_bucket *f = phash_find(pptr(h->table), h->cap, key);
+  if (f) {
+    if (ptx_add(&f->val, sizeof(f->val)) == -1) {
+      return -1;
+    }
+    f->val = val;
+    return 0;
+  }
+  // a key that was not moved yet moves right now
+  if (h->old != POFF_NULL) {
+    struct phash_bucket *o = phash_find(pptr(h->old), h->old_cap, key);
+    if (o) {
+      if (ptx_add(o, sizeof(*o)) == -1) {
+        return -1;
+      }
+      o->key = PHASH_TOMB;
+      h->count--;
+    }
+  }
+  if ((h->used + 1) * 10 > h->cap * PHASH_MAX_LOAD && resize_start(h) == -1) {
+    return -1;
+  }
+
+  struct phash_bucket *s = phash_slot(pptr(h->table), h->cap, key);
+  if (ptx_add(s, sizeof(*s)) == -1) {
+    return -1;
+  }
+  if (s->key == PHASH_EMPTY) {
+    h->used++;
+  }
+  s->key = key;
+  s->val = val;
+  h->count++;
+  return 0;
+}
+
+bool phash_del(struct phash *h, uint64_t key) {
+  if (key == PHASH_EMPTY || key == PHASH_TOMB) {
+    return false;
+  }
+  if (ptx_add(h, sizeof(*h)) == -1) {
+    return false;
+  }
+  if (h->old != POFF_NULL && migrate(h, PHASH_MIGRATE_STEP) == -1) {
+    return false;
+  }
+  struct phash_bucket *f = phash_find(pptr(h->table), h->cap, key);
+  if (!f && h->old != POFF_NULL) {
+    f = phash_find(pptr(h->old), h->old_cap, key);
+  }
+  if (!f || ptx_add(f, sizeof(*f)) == -1) {
+    return false;
+  }
+  f->key = PHASH_TOMB;
+  h->count--;
+  return true;
+}
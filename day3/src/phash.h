@@ -0,0 +1,53 @@
+#ifndef PHASH_H
+#define PHASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "palloc.h"
+
+// keys 0 and UINT64_MAX are reserved to mark empty and deleted buckets
+#define PHASH_EMPTY 0ull
+#define PHASH_TOMB UINT64_MAX
+
+// buckets moved from the old to the new table by every operation while the
+// table is being resized
+#define PHASH_MIGRATE_STEP 64
+
+struct phash_bucket {
+  uint64_t key;
+  uint64_t val;
+};
+
+// open-addressing (linear probing) hash table on the persistent heap, the
+// header lives in the persistent section. Resizing is incremental: a larger
+// table is allocated and every following operation moves a few buckets
+// over, lookups consult both tables until the old one is drained.
+struct phash {
+  uint64_t magic;
+  poff_t table;
+  uint64_t cap;       // power of two
+  uint64_t count;     // live keys in both tables
+  uint64_t used;      // live and deleted buckets in table
+  poff_t old;         // table being drained, POFF_NULL if not resizing
+  uint64_t old_cap;
+  uint64_t migrated;  // buckets of old that were moved already
+};
+
+// sets up an empty table on first use, must be called after pheap_open
+int phash_init(struct phash *h, uint64_t cap);
+
+bool phash_get(struct phash *h, uint64_t key, uint64_t *val);
+int phash_put(struct phash *h, uint64_t key, uint64_t val);
+bool phash_del(struct phash *h, uint64_t key);
+
+// number of live keys
+uint64_t phash_count(const struct phash *h);
+
+// probing on a plain bucket array, shared with volatile tables
+uint64_t phash_hash(uint64_t key);
+struct phash_bucket *phash_find(struct phash_bucket *b, uint64_t cap, uint64_t key);
+struct phash_bucket *phash_slot(struct phash_bucket *b, uint64_t cap, uint64_t key);
+
+#endif
@@ -0,0 +1,20 @@
+#define _GNU_SOURCE
+#include "pstat.h"
+
+#include <sched.h>
+
+void pstat_add(struct pstat *st, unsigned idx, uint64_t delta) {
+  // a migration between here and the add only costs a shared line, the
+  // add itself stays atomic
+  int cpu = sched_getcpu();
+  struct pstat_slot *slot = &st->slots[(cpu < 0 ? 0 : cpu) % PSTAT_NSLOTS];
+  atomic_fetch_add_explicit(&slot->v[idx], delta, memory_order_relaxed);
+}
+
+uint64_t pstat_read(struct pstat *st, unsigned idx) {
+  uint64_t sum = 0;
+  for (unsigned i = 0; i < PSTAT_NSLOTS; ++i) {
+    sum += atomic_load_explicit(&st->slots[i].v[idx], memory_order_relaxed);
+  }
+  return sum;
+}
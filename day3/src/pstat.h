@@ -0,0 +1,32 @@
+#ifndef PSTAT_H
+#define PSTAT_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define PSTAT_CACHE_LINE 64
+
+// counters per block, one slot holds all of them in a single cache line
+#define PSTAT_NCOUNTERS (PSTAT_CACHE_LINE / sizeof(uint64_t))
+
+// CPUs beyond this share slots, which is still correct but contends again.
+// Kept small so that a block fits into the persistent section's page.
+#define PSTAT_NSLOTS 32
+
+struct pstat_slot {
+  _Alignas(PSTAT_CACHE_LINE) _Atomic uint64_t v[PSTAT_NCOUNTERS];
+};
+
+// block of counters shared by every process that maps it. Writers only
+// touch the slot of the CPU they run on, readers sum up all slots. Zeroed
+// memory is a valid empty block.
+struct pstat {
+  struct pstat_slot slots[PSTAT_NSLOTS];
+};
+
+void pstat_add(struct pstat *st, unsigned idx, uint64_t delta);
+
+// sum over all slots, concurrent adds may or may not be included
+uint64_t pstat_read(struct pstat *st, unsigned idx);
+
+#endif
@@ -0,0 +1,482 @@
+#define _GNU_SOURCE
+#include "ptx.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+// the log lives on the heap, a reinitialized heap means a new log
+#define PTX_MAGIC 0x32676f6c78747064ull
+
+// where a logged range lives, the section is mapped at a fixed file offset
+// while heap data is addressed through poff_t
+enum ptx_region {
+  REGION_SECTION,
+  REGION_HEAP,
+};
+
+// undo record, holds the contents of [off, off + len) from before the update.
+// The checksum covers header and data, so an entry torn by a crash while it
+// was written is detected, the range it describes was not modified yet.
+struct ptx_entry {
+  uint64_t gen;
+  uint64_t off;
+  uint32_t region;
+  uint32_t len;
+  uint64_t csum;
+  uint8_t data[];
+};
+
+struct ptx_range {
+  uint32_t region;
+  uint32_t len;
+  uint64_t off;
+};
+
+// in-memory copy of a range taken by ptx_add, used by ptx_abort
+struct ptx_snap {
+  void *ptr;
+  size_t len;
+  uint8_t *data;
+};
+
+static struct {
+  struct ptx_log *log;
+  uint8_t *section;
+  size_t section_len;
+  uint8_t *log_base;
+  uint64_t tail;            // bytes of the log used by the current generation
+  bool active;
+  int lock_fd;              // flock'ed while this process owns the log
+  bool locked;
+  unsigned nheld;           // ptx_lock calls not yet undone by ptx_unlock
+  unsigned group;
+  unsigned ncommitted;      // commits since the last flush
+  struct ptx_range *ranges; // logged in the current generation
+  size_t nranges;
+  size_t ranges_cap;
+  struct ptx_snap *snaps;   // taken by the current transaction
+  size_t nsnaps;
+  size_t snaps_cap;
+} tx = { .group = 1, .lock_fd = -1 };
+
+static size_t page_size(void) {
+  return sysconf(_SC_PAGE_SIZE);
+}
+
+static int sync_range(void *addr, size_t len) {
+  uintptr_t start = (uintptr_t)addr & ~(page_size() - 1);
+  uintptr_t end = (uintptr_t)addr + len;
+  if (msync((void *)start, end - start, MS_SYNC) == -1) {
+    fprintf(stderr, "msync failed with errno %d\n", errno);
+    return -1;
+  }
+  return 0;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+  const uint8_t *p = data;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= p[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+static uint64_t entry_csum(const struct ptx_entry *e) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  hash = fnv1a(hash, e, offsetof(struct ptx_entry, csum));
+  return fnv1a(hash, e->data, e->len);
+}
+
+static size_t entry_size(size_t len) {
+  return (sizeof(struct ptx_entry) + len + 7) & ~(size_t)7;
+}
+
+static int resolve(const void *ptr, size_t len, struct ptx_range *r) {
+  const uint8_t *p = ptr;
+  if (p >= tx.section && p + len <= tx.section + tx.section_len) {
+    r->region = REGION_SECTION;
+    r->off = p - tx.section;
+  } else {
+    r->region = REGION_HEAP;
+    r->off = poff(ptr);
+    if (r->off == POFF_NULL || r->off + len > pheap_mapped_size()) {
+      fprintf(stderr, "ptx: %p is neither in the persistent section nor heap\n", ptr);
+      return -1;
+    }
+  }
+  r->len = len;
+  return 0;
+}
+
+// returns NULL for ranges that are not mapped (any more)
+static void *range_ptr(const struct ptx_range *r) {
+  if (r->region == REGION_SECTION) {
+    return r->off + r->len <= tx.section_len ? tx.section + r->off : NULL;
+  }
+  return r->off + r->len <= pheap_mapped_size() ? pptr(r->off) : NULL;
+}
+
+static bool range_logged(const struct ptx_range *r) {
+  for (size_t i = 0; i < tx.nranges; ++i) {
+    const struct ptx_range *l = &tx.ranges[i];
+    if (l->region == r->region && l->off <= r->off && r->off + r->len <= l->off + l->len) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// starts a new log generation, everything logged so far becomes invalid
+static int log_reset(void) {
+  tx.log->gen++;
+  tx.tail = 0;
+  tx.nranges = 0;
+  tx.ncommitted = 0;
+  return sync_range(&tx.log->gen, sizeof(tx.log->gen));
+}
+
+static int log_create(void) {
+  void *log = palloc(PTX_LOG_SIZE);
+  if (!log) {
+    fprintf(stderr, "failed to allocate transaction log\n");
+    return -1;
+  }
+  // fresh heap memory is zero, no entry matches a generation >= 1
+  tx.log->log = poff(log);
+  tx.log->size = PTX_LOG_SIZE;
+  tx.log->gen = 1;
+  tx.log->magic = PTX_MAGIC;
+  if (pheap_sync() == -1) {
+    return -1;
+  }
+  return sync_range(tx.section, tx.section_len);
+}
+
+// rolls back all valid entries of the current generation, newest first
+static int log_recover(void) {
+  size_t nentries = 0;
+  uint64_t pos = 0;
+  while (pos + sizeof(struct ptx_entry) <= tx.log->size) {
+    struct ptx_entry *e = (struct ptx_entry *)(tx.log_base + pos);
+    if (e->gen != tx.log->gen || pos + entry_size(e->len) > tx.log->size
+        || e->csum != entry_csum(e)) {
+      break;
+    }
+    nentries++;
+    pos += entry_size(e->len);
+  }
+  if (nentries == 0) {
+    return 0;
+  }
+
+  struct ptx_entry **entries = calloc(nentries, sizeof(*entries));
+  if (!entries) {
+    fprintf(stderr, "failed to allocate recovery buffer\n");
+    return -1;
+  }
+  pos = 0;
+  for (size_t i = 0; i < nentries; ++i) {
+    entries[i] = (struct ptx_entry *)(tx.log_base + pos);
+    pos += entry_size(entries[i]->len);
+  }
+  for (size_t i = nentries; i-- > 0;) {
+    struct ptx_range r = { entries[i]->region, entries[i]->len, entries[i]->off };
+    // a range past the end of the heap was handed out by the interrupted
+    // transaction itself, after the rollback it is unused again
+    void *dst = range_ptr(&r);
+    if (dst) {
+      memcpy(dst, entries[i]->data, r.len);
+      sync_range(dst, r.len);
+    }
+  }
+  free(entries);
+  if (log_reset() == -1) {
+    return -1;
+  }
+  return nentries;
+}
+
+// the log is shared by every process that maps the file. A process owns it
+// from its first ptx_begin until the group is flushed (or the transaction
+// aborted), everything it logged is then durable or rolled back and the log
+// is empty again for the next owner. An owner that died leaves its entries
+// behind, whoever takes the lock next rolls them back.
+static int log_lock(void) {
+  if (tx.locked) {
+    return 0;
+  }
+  while (flock(tx.lock_fd, LOCK_EX) == -1) {
+    if (errno != EINTR) {
+      fprintf(stderr, "flock of the transaction log failed with errno %d\n", errno);
+      return -1;
+    }
+  }
+  tx.locked = true;
+  tx.tail = 0;
+  tx.nranges = 0;
+  tx.ncommitted = 0;
+  if (pheap_remap() == -1) {
+    return -1;
+  }
+  return log_recover();
+}
+
+// a ptx_lock holder keeps the lock past the end of a group
+static void log_unlock(void) {
+  if (tx.nheld > 0) {
+    return;
+  }
+  if (tx.locked && flock(tx.lock_fd, LOCK_UN) == -1) {
+    fprintf(stderr, "unlocking the transaction log failed with errno %d\n", errno);
+  }
+  tx.locked = false;
+}
+
+int ptx_init(struct ptx_log *log, void *section, size_t section_len, const char *fname) {
+  tx.log = log;
+  tx.section = section;
+  tx.section_len = section_len;
+  // a descriptor of our own, flock locks belong to the open file
+  tx.lock_fd = open(fname, O_RDONLY | O_CLOEXEC);
+  if (tx.lock_fd == -1) {
+    fprintf(stderr, "failed to open file %s with errno %d\n", fname, errno);
+    return -1;
+  }
+  while (flock(tx.lock_fd, LOCK_EX) == -1) {
+    if (errno != EINTR) {
+      fprintf(stderr, "flock of %s failed with errno %d\n", fname, errno);
+      return -1;
+    }
+  }
+  tx.locked = true;
+  tx.nheld = 1;
+  int nentries = -1;
+  if (pheap_remap() == 0 && (log->magic == PTX_MAGIC || log_create() == 0)) {
+    tx.log_base = pptr(log->log);
+    tx.tail = 0;
+    nentries = log_recover();
+  }
+  ptx_unlock();
+  return nentries;
+}
+
+int ptx_lock(void) {
+  if (log_lock() == -1) {
+    return -1;
+  }
+  tx.nheld++;
+  return 0;
+}
+
+void ptx_unlock(void) {
+  if (tx.nheld > 0) {
+    tx.nheld--;
+  }
+  // an open transaction or group still owns the log
+  if (!tx.active && tx.ncommitted == 0) {
+    log_unlock();
+  }
+}
+
+void ptx_set_group(unsigned n) {
+  tx.group = n > 0 ? n : 1;
+}
+
+int ptx_active(void) {
+  return tx.active;
+}
+
+int ptx_begin(void) {
+  if (tx.active) {
+    fprintf(stderr, "ptx_begin: transaction already open\n");
+    return -1;
+  }
+  if (log_lock() == -1) {
+    return -1;
+  }
+  // don't let a group run the log full in the middle of a transaction
+  if (tx.ncommitted > 0 && tx.tail > tx.log->size / 4 * 3 && ptx_flush() == -1) {
+    return -1;
+  }
+  tx.active = true;
+  return 0;
+}
+
+static int snap_add(void *ptr, size_t len) {
+  for (size_t i = 0; i < tx.nsnaps; ++i) {
+    uint8_t *s = tx.snaps[i].ptr;
+    if (s <= (uint8_t *)ptr && (uint8_t *)ptr + len <= s + tx.snaps[i].len) {
+      return 0;
+    }
+  }
+  if (tx.nsnaps == tx.snaps_cap) {
+    size_t cap = tx.snaps_cap ? tx.snaps_cap * 2 : 16;
+    struct ptx_snap *snaps = realloc(tx.snaps, cap * sizeof(*snaps));
+    if (!snaps) {
+      return -1;
+    }
+    tx.snaps = snaps;
+    tx.snaps_cap = cap;
+  }
+  uint8_t *data = malloc(len);
+  if (!data) {
+    return -1;
+  }
+  memcpy(data, ptr, len);
+  tx.snaps[tx.nsnaps++] = (struct ptx_snap){ ptr, len, data };
+  return 0;
+}
+
+static int range_add(const struct ptx_range *r) {
+  if (tx.nranges == tx.ranges_cap) {
+    size_t cap = tx.ranges_cap ? tx.ranges_cap * 2 : 64;
+    struct ptx_range *ranges = realloc(tx.ranges, cap * sizeof(*ranges));
+    if (!ranges) {
+      return -1;
+    }
+    tx.ranges = ranges;
+    tx.ranges_cap = cap;
+  }
+  tx.ranges[tx.nranges++] = *r;
+  return 0;
+}
+
+int ptx_add(void *ptr, size_t len) {
+  if (!tx.active) {
+    return 0;
+  }
+  struct ptx_range r;
+  if (resolve(ptr, len, &r) == -1) {
+    return -1;
+  }
+  if (snap_add(ptr, len) == -1) {
+    fprintf(stderr, "ptx_add: out of memory\n");
+    return -1;
+  }
+  // within a group only the oldest contents of a range matter
+  if (range_logged(&r)) {
+    return 0;
+  }
+
+  size_t esize = entry_size(len);
+  if (tx.tail + esize > tx.log->size) {
+    fprintf(stderr, "ptx_add: transaction log is full\n");
+    return -1;
+  }
+  struct ptx_entry *e = (struct ptx_entry *)(tx.log_base + tx.tail);
+  e->gen = tx.log->gen;
+  e->off = r.off;
+  e->region = r.region;
+  e->len = len;
+  memcpy(e->data, ptr, len);
+  e->csum = entry_csum(e);
+  // the undo record has to be on disk before the range may change
+  if (sync_range(e, esize) == -1 || range_add(&r) == -1) {
+    return -1;
+  }
+  tx.tail += esize;
+  return 0;
+}
+
+static void snaps_clear(void) {
+  for (size_t i = 0; i < tx.nsnaps; ++i) {
+    free(tx.snaps[i].data);
+  }
+  tx.nsnaps = 0;
+}
+
+int ptx_commit(void) {
+  if (!tx.active) {
+    fprintf(stderr, "ptx_commit: no open transaction\n");
+    return -1;
+  }
+  tx.active = false;
+  snaps_clear();
+  tx.ncommitted++;
+  if (tx.ncommitted < tx.group) {
+    return 0;
+  }
+  return ptx_flush();
+}
+
+static int cmp_range(const void *a, const void *b) {
+  uintptr_t x = ((const uintptr_t *)a)[0];
+  uintptr_t y = ((const uintptr_t *)b)[0];
+  return (x > y) - (x < y);
+}
+
+// msyncs every page touched in this generation, neighbouring and
+// overlapping ranges are merged so each page is synced once
+static int sync_ranges(void) {
+  uintptr_t (*pages)[2] = calloc(tx.nranges, sizeof(*pages));
+  if (!pages && tx.nranges > 0) {
+    return -1;
+  }
+  size_t npages = 0;
+  for (size_t i = 0; i < tx.nranges; ++i) {
+    uint8_t *ptr = range_ptr(&tx.ranges[i]);
+    if (!ptr) {
+      continue;
+    }
+    pages[npages][0] = (uintptr_t)ptr & ~(page_size() - 1);
+    pages[npages][1] = (uintptr_t)ptr + tx.ranges[i].len;
+    npages++;
+  }
+  qsort(pages, npages, sizeof(*pages), cmp_range);
+
+  int rc = 0;
+  size_t i = 0;
+  while (i < npages) {
+    uintptr_t start = pages[i][0];
+    uintptr_t end = pages[i][1];
+    for (++i; i < npages && pages[i][0] <= end; ++i) {
+      if (pages[i][1] > end) {
+        end = pages[i][1];
+      }
+    }
+    if (sync_range((void *)start, end - start) == -1) {
+      rc = -1;
+    }
+  }
+  free(pages);
+  return rc;
+}
+
+void ptx_abort(void) {
+  for (size_t i = tx.nsnaps; i-- > 0;) {
+    memcpy(tx.snaps[i].ptr, tx.snaps[i].data, tx.snaps[i].len);
+  }
+  snaps_clear();
+  tx.active = false;
+  // nothing of the group is left to make durable, the log can go. The
+  // kernel may have written back the aborted changes already, so the
+  // restored ranges have to be on disk before their undo entries are gone.
+  if (tx.ncommitted == 0 && sync_ranges() == 0 && log_reset() == 0) {
+    log_unlock();
+  }
+}
+
+int ptx_flush(void) {
+  if (tx.active) {
+    fprintf(stderr, "ptx_flush: can't flush an open transaction\n");
+    return -1;
+  }
+  if (tx.nranges == 0) {
+    tx.ncommitted = 0;
+    log_unlock();
+    return 0;
+  }
+  if (sync_ranges() == -1 || log_reset() == -1) {
+    return -1;
+  }
+  log_unlock();
+  return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef PTX_H
+#define PTX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "palloc.h"
+
+// size of the undo log on the persistent heap
+#define PTX_LOG_SIZE (4ull << 20)
+
+// log header, lives in the persistent section. Every log entry carries the
+// generation it was written in, bumping gen discards the whole log at once.
+struct ptx_log {
+  uint64_t magic;
+  uint64_t gen;
+  poff_t log;
+  uint64_t size;
+};
+
+// sets up the undo log (allocating it on first use) and rolls back whatever
+// transaction was interrupted by a crash. section and section_len describe
+// the mapped persistent section, log has to live inside it.
+// Processes sharing fname serialize on an flock of it: recovery and each
+// group of transactions, from ptx_begin until the group is flushed, hold it
+// exclusively. Processes forked after ptx_init share the lock and must not
+// run transactions concurrently.
+// Returns the number of undone log entries or -1 on error.
+int ptx_init(struct ptx_log *log, void *section, size_t section_len, const char *fname);
+
+// hold the log lock for heap updates made outside of a transaction, so they
+// don't interleave with another process's transaction. Calls nest, and the
+// lock stays held while a transaction or group still needs it.
+int ptx_lock(void);
+void ptx_unlock(void);
+
+// with n > 1, ptx_commit only makes every n-th commit durable (or whatever
+// ptx_flush forces), a crash rolls back all transactions since then
+void ptx_set_group(unsigned n);
+
+int ptx_begin(void);
+
+// must be called before modifying [ptr, ptr + len), saves its old contents
+// to the undo log and makes that durable before returning
+int ptx_add(void *ptr, size_t len);
+
+// msyncs all modified ranges in one batch and then invalidates the log
+int ptx_commit(void);
+
+// restores everything the current transaction modified
+void ptx_abort(void);
+
+// makes all committed transactions of the current group durable
+int ptx_flush(void);
+
+// true while a transaction is open
+int ptx_active(void);
+
+#endif
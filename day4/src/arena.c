@@ -0,0 +1,111 @@
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const uint32_t class_sizes[ARENA_NCLASSES] = ARENA_CLASS_SIZES;
+
+size_t arena_size(uint32_t nslots) {
+  size_t size = sizeof(struct arena);
+  for (int i = 0; i < ARENA_NCLASSES; ++i) {
+    size += (size_t)nslots * (class_sizes[i] + sizeof(struct arena_slot));
+  }
+  return size;
+}
+
+void arena_init(struct arena *arena, uint32_t nslots) {
+  memset(arena, 0, sizeof(*arena));
+  uint64_t off = sizeof(struct arena);
+  for (int i = 0; i < ARENA_NCLASSES; ++i) {
+    struct arena_class *cls = &arena->classes[i];
+    cls->size = class_sizes[i];
+    cls->nslots = nslots;
+    cls->data_off = off;
+    off += (uint64_t)nslots * cls->size;
+    cls->slots_off = off;
+    off += (uint64_t)nslots * sizeof(struct arena_slot);
+
+    struct arena_slot *slots = (struct arena_slot *)((uint8_t *)arena + cls->slots_off);
+    for (uint32_t s = 0; s < nslots; ++s) {
+      atomic_init(&slots[s].next, s + 1 < nslots ? s + 2 : 0);
+      slots[s].len = 0;
+    }
+    atomic_init(&cls->free_head, nslots > 0 ? 1 : 0);
+  }
+  arena->size = off;
+}
+
+static struct arena_slot *class_slots(struct arena *arena, struct arena_class *cls) {
+  return (struct arena_slot *)((uint8_t *)arena + cls->slots_off);
+}
+
+// class and slot index h points into, aborts on handles from elsewhere
+static struct arena_class *handle_class(struct arena *arena, arena_handle h, uint32_t *idx) {
+  for (int i = 0; i < ARENA_NCLASSES; ++i) {
+    struct arena_class *cls = &arena->classes[i];
+    if (h >= cls->data_off && h < cls->data_off + (uint64_t)cls->nslots * cls->size) {
+      *idx = (h - cls->data_off) / cls->size;
+      return cls;
+    }
+  }
+  fprintf(stderr, "invalid arena handle %lu\n", h);
+  abort();
+}
+
+arena_handle arena_reserve(struct arena *arena, size_t size, void **ptr) {
+  struct arena_class *cls = NULL;
+  for (int i = 0; i < ARENA_NCLASSES; ++i) {
+    if (size <= arena->classes[i].size) {
+      cls = &arena->classes[i];
+      break;
+    }
+  }
+  if (!cls) {
+    return ARENA_NULL;
+  }
+  struct arena_slot *slots = class_slots(arena, cls);
+  uint64_t head = atomic_load_explicit(&cls->free_head, memory_order_acquire);
+  uint64_t next;
+  do {
+    uint32_t idx = (uint32_t)head;
+    if (idx == 0) {
+      return ARENA_NULL;
+    }
+    // may be stale if another process popped idx meanwhile, the tag makes
+    // the CAS fail in that case
+    uint32_t link = atomic_load_explicit(&slots[idx - 1].next, memory_order_relaxed);
+    next = ((head >> 32) + 1) << 32 | link;
+  } while (!atomic_compare_exchange_weak_explicit(&cls->free_head, &head, next,
+                                                  memory_order_acquire, memory_order_acquire));
+  uint32_t idx = (uint32_t)head - 1;
+  arena_handle h = cls->data_off + (uint64_t)idx * cls->size;
+  *ptr = (uint8_t *)arena + h;
+  return h;
+}
+
+void arena_commit(struct arena *arena, arena_handle h, size_t len) {
+  uint32_t idx;
+  struct arena_class *cls = handle_class(arena, h, &idx);
+  class_slots(arena, cls)[idx].len = len;
+}
+
+const void *arena_consume(struct arena *arena, arena_handle h, size_t *len) {
+  uint32_t idx;
+  struct arena_class *cls = handle_class(arena, h, &idx);
+  *len = class_slots(arena, cls)[idx].len;
+  return (uint8_t *)arena + h;
+}
+
+void arena_release(struct arena *arena, arena_handle h) {
+  uint32_t idx;
+  struct arena_class *cls = handle_class(arena, h, &idx);
+  struct arena_slot *slot = &class_slots(arena, cls)[idx];
+  uint64_t head = atomic_load_explicit(&cls->free_head, memory_order_relaxed);
+  uint64_t next;
+  do {
+    atomic_store_explicit(&slot->next, (uint32_t)head, memory_order_relaxed);
+    next = ((head >> 32) + 1) << 32 | (idx + 1);
+  } while (!atomic_compare_exchange_weak_explicit(&cls->free_head, &head, next,
+                                                  memory_order_release, memory_order_relaxed));
+}
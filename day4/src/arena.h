@@ -0,0 +1,64 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "spsc.h"
+
+// payload capacities of the slab classes
+#define ARENA_NCLASSES 4
+#define ARENA_CLASS_SIZES { 64, 256, 1024, 4096 }
+
+// message handle, the byte offset of the payload from the start of the
+// arena. It means the same in every process that maps the arena, wherever
+// the mapping lands. ARENA_NULL is never a valid handle.
+typedef uint64_t arena_handle;
+#define ARENA_NULL ((arena_handle)0)
+
+struct arena_slot {
+  atomic_uint next;   // index + 1 of the next free slot, 0 ends the list
+  uint32_t len;       // bytes committed
+};
+
+// slabs of one payload size. The free list is a lock-free stack of slot
+// indices, its head carries a tag in the upper half against ABA.
+struct arena_class {
+  _Alignas(CACHE_LINE) _Atomic uint64_t free_head;
+  uint32_t size;
+  uint32_t nslots;
+  uint64_t data_off;  // first payload
+  uint64_t slots_off; // struct arena_slot array
+};
+
+// shared-memory payload arena. Producers reserve a slot, write the message
+// in place and commit it, then pass the handle through a queue. Consumers
+// read it where it is and release the slot when done.
+struct arena {
+  uint64_t size;
+  struct arena_class classes[ARENA_NCLASSES];
+};
+
+// bytes needed for nslots slots in every class
+size_t arena_size(uint32_t nslots);
+
+// the arena must be placed in MAP_SHARED memory of arena_size(nslots) bytes
+void arena_init(struct arena *arena, uint32_t nslots);
+
+// hands out a slot for up to size bytes and stores its address in *ptr.
+// Returns ARENA_NULL if size exceeds the largest class or its class is
+// exhausted, callers retry once consumers released slots.
+arena_handle arena_reserve(struct arena *arena, size_t size, void **ptr);
+
+// records the length of the message written to a reserved slot, the handle
+// may then be handed to other processes
+void arena_commit(struct arena *arena, arena_handle h, size_t len);
+
+// returns the message behind h and stores its length in *len
+const void *arena_consume(struct arena *arena, arena_handle h, size_t *len);
+
+// gives the slot back once the message is no longer used
+void arena_release(struct arena *arena, arena_handle h);
+
+#endif
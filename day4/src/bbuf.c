@@ -0,0 +1,91 @@
+#include "bbuf.h"
+#include "futex.h"
+#include "sem.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <linux/futex.h>
+
+// older headers only know the futex_waitv flag under its first name
+#ifndef FUTEX2_SIZE_U32
+#define FUTEX2_SIZE_U32 FUTEX_32
+#endif
+
+void bbuf_init(BoundedBuffer *buffer) {
+  sem_init(&buffer->slots, BOUNDED_BUFFER_LEN);
+  sem_init(&buffer->elements, 0);
+  sem_init(&buffer->lock, 1);
+  buffer->write_idx = 0;
+  buffer->read_idx = 0;
+}
+
+void bbuf_put(BoundedBuffer *buffer, void *data) {
+  sem_decr(&buffer->slots);
+  sem_decr(&buffer->lock);
+  buffer->data[buffer->write_idx] = data;
+  buffer->write_idx = (buffer->write_idx + 1) % BOUNDED_BUFFER_LEN;
+  sem_incr(&buffer->lock);
+  sem_incr(&buffer->elements);
+}
+
+void *bbuf_get(BoundedBuffer *buffer) {
+  void *ret = NULL;
+  sem_decr(&buffer->elements);
+  sem_decr(&buffer->lock);
+  ret = buffer->data[buffer->read_idx];
+  buffer->read_idx = (buffer->read_idx + 1) % BOUNDED_BUFFER_LEN;
+  sem_incr(&buffer->lock);
+  sem_incr(&buffer->slots);
+  return ret;
+}
+
+int bbuf_put_many(BoundedBuffer *buffer, void **data, int n) {
+  int k = sem_decr_many(&buffer->slots, n);
+  sem_decr(&buffer->lock);
+  for (int i = 0; i < k; ++i) {
+    buffer->data[buffer->write_idx] = data[i];
+    buffer->write_idx = (buffer->write_idx + 1) % BOUNDED_BUFFER_LEN;
+  }
+  sem_incr(&buffer->lock);
+  sem_incr_many(&buffer->elements, k);
+  return k;
+}
+
+int bbuf_get_many(BoundedBuffer *buffer, void **data, int n) {
+  int k = sem_decr_many(&buffer->elements, n);
+  sem_decr(&buffer->lock);
+  for (int i = 0; i < k; ++i) {
+    data[i] = buffer->data[buffer->read_idx];
+    buffer->read_idx = (buffer->read_idx + 1) % BOUNDED_BUFFER_LEN;
+  }
+  sem_incr(&buffer->lock);
+  sem_incr_many(&buffer->slots, k);
+  return k;
+}
+
+int bbuf_wait_any(BoundedBuffer **buffers, int n) {
+  if (n <= 0 || n > FUTEX_WAITV_MAX) {
+    fprintf(stderr, "bbuf_wait_any: can wait on 1 to %d buffers\n", FUTEX_WAITV_MAX);
+    return -1;
+  }
+  struct futex_waitv waiters[FUTEX_WAITV_MAX];
+  for (;;) {
+    for (int i = 0; i < n; ++i) {
+      if (atomic_load(&buffers[i]->elements) > 0) {
+        return i;
+      }
+    }
+    // sleeps unless one of the counters moved away from 0 since the check
+    for (int i = 0; i < n; ++i) {
+      waiters[i] = (struct futex_waitv){
+        .val = 0,
+        .uaddr = (uintptr_t)&buffers[i]->elements,
+        .flags = FUTEX2_SIZE_U32,
+      };
+    }
+    if (futex_waitv(waiters, n, NULL) == -1 && errno != EAGAIN && errno != EINTR) {
+      fprintf(stderr, "futex_waitv failed with errno %d\n", errno);
+      return -1;
+    }
+  }
+}
@@ -0,0 +1,33 @@
+#ifndef BBUF_H
+#define BBUF_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define BOUNDED_BUFFER_LEN 3
+
+typedef struct {
+  atomic_int slots;
+  atomic_int elements;
+  atomic_int lock; 
+  uint32_t read_idx;
+  uint32_t write_idx;
+  void *data[BOUNDED_BUFFER_LEN];
+} BoundedBuffer;
+
+void bbuf_init(BoundedBuffer *buffer);
+void bbuf_put(BoundedBuffer *buffer, void *data);
+void *bbuf_get(BoundedBuffer *buffer);
+
+// move between 1 and n items with one pass through the semaphores and the
+// lock, blocking until at least one fits / is there. Return the number of
+// items moved.
+int bbuf_put_many(BoundedBuffer *buffer, void **data, int n);
+int bbuf_get_many(BoundedBuffer *buffer, void **data, int n);
+
+// blocks until one of the n buffers holds elements and returns its index.
+// All buffers are waited on with a single futex_waitv. With only one
+// consumer per buffer the following bbuf_get_many won't block.
+int bbuf_wait_any(BoundedBuffer **buffers, int n);
+
+#endif
@@ -0,0 +1,560 @@
+#define _GNU_SOURCE
+#include "bench.h"
+#include "arena.h"
+#include "bbuf.h"
+#include "mpmc.h"
+#include "sem.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sched.h>
+
+static void *shared_alloc(size_t len) {
+  void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+  if (mem == MAP_FAILED) {
+    fprintf(stderr, "failed to create shared memory area, errno %d\n", errno);
+    return NULL;
+  }
+  return mem;
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// items are (producer + 1) << 32 | sequence, never NULL, which ends a consumer
+static void *stress_item(unsigned prod, uint32_t seq) {
+  return (void *)(((uintptr_t)(prod + 1) << 32) | seq);
+}
+
+static void stress_consume(struct mpmc *queue, atomic_uchar *seen, unsigned nprod, uint32_t n,
+                           atomic_uint *disorder) {
+  uint32_t *last = calloc(nprod, sizeof(*last));
+  void *item;
+  while ((item = mpmc_get(queue)) != NULL) {
+    unsigned prod = ((uintptr_t)item >> 32) - 1;
+    uint32_t seq = (uint32_t)(uintptr_t)item;
+    if (prod >= nprod || seq >= n) {
+      atomic_fetch_add(disorder, 1);
+      continue;
+    }
+    if (last && seq < last[prod]) {
+      atomic_fetch_add(disorder, 1);
+    }
+    if (last) {
+      last[prod] = seq;
+    }
+    atomic_fetch_add_explicit(&seen[(size_t)prod * n + seq], 1, memory_order_relaxed);
+  }
+  free(last);
+}
+
+int mpmc_stress(unsigned nprod, unsigned ncons, uint32_t n, uint32_t cap) {
+  size_t qlen = mpmc_size(cap);
+  size_t seenlen = (size_t)nprod * n + sizeof(atomic_uint);
+  struct mpmc *queue = shared_alloc(qlen);
+  atomic_uchar *seen = shared_alloc(seenlen);
+  if (!queue || !seen) {
+    return 1;
+  }
+  atomic_uint *disorder = (atomic_uint *)((uint8_t *)seen + (size_t)nprod * n);
+  if (mpmc_init(queue, cap) == -1) {
+    fprintf(stderr, "queue capacity %u is not a power of two >= 2\n", cap);
+    return 1;
+  }
+
+  double t0 = now_sec();
+  for (unsigned c = 0; c < ncons; ++c) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      fprintf(stderr, "fork failed with errno %d\n", errno);
+      return 1;
+    }
+    if (pid == 0) {
+      stress_consume(queue, seen, nprod, n, disorder);
+      _exit(0);
+    }
+  }
+  pid_t *producers = calloc(nprod, sizeof(*producers));
+  for (unsigned p = 0; p < nprod; ++p) {
+    producers[p] = fork();
+    if (producers[p] == -1) {
+      fprintf(stderr, "fork failed with errno %d\n", errno);
+      return 1;
+    }
+    if (producers[p] == 0) {
+      for (uint32_t i = 0; i < n; ++i) {
+        mpmc_put(queue, stress_item(p, i));
+      }
+      _exit(0);
+    }
+  }
+  for (unsigned p = 0; p < nprod; ++p) {
+    waitpid(producers[p], NULL, 0);
+  }
+  // one end marker per consumer, queued behind all items
+  for (unsigned c = 0; c < ncons; ++c) {
+    mpmc_put(queue, NULL);
+  }
+  while (wait(NULL) > 0)
+    ;
+  double secs = now_sec() - t0;
+
+  uint64_t lost = 0, dup = 0;
+  for (size_t i = 0; i < (size_t)nprod * n; ++i) {
+    unsigned char cnt = atomic_load_explicit(&seen[i], memory_order_relaxed);
+    if (cnt == 0) {
+      lost++;
+    } else if (cnt > 1) {
+      dup += cnt - 1;
+    }
+  }
+  unsigned bad_order = atomic_load(disorder);
+  uint64_t total = (uint64_t)nprod * n;
+  printf("%u,%u,%u,%lu,%lu,%lu,%u,%.0f\n", nprod, ncons, cap, total, lost, dup, bad_order,
+         total / secs);
+
+  free(producers);
+  munmap(queue, qlen);
+  munmap(seen, seenlen);
+  return lost || dup || bad_order;
+}
+
+// one semaphore flavour, post and wait on the i-th of a pair
+struct sem_mode {
+  const char *name;
+  void (*init)(void *sems, unsigned spin);
+  void (*post)(void *sems, int i);
+  void (*wait)(void *sems, int i);
+  unsigned spin;
+};
+
+static void plain_init(void *sems, unsigned spin) {
+  sem_init(&((atomic_int *)sems)[0], 0);
+  sem_init(&((atomic_int *)sems)[1], 0);
+}
+
+static void plain_post(void *sems, int i) {
+  sem_incr(&((atomic_int *)sems)[i]);
+}
+
+static void plain_wait(void *sems, int i) {
+  sem_decr(&((atomic_int *)sems)[i]);
+}
+
+// the two fsems sit on separate cache lines, like they would in a queue
+struct padded_fsem {
+  _Alignas(64) struct fsem sem;
+};
+
+static void fsem_pair_init(void *sems, unsigned spin) {
+  fsem_init(&((struct padded_fsem *)sems)[0].sem, 0, spin);
+  fsem_init(&((struct padded_fsem *)sems)[1].sem, 0, spin);
+}
+
+static void fsem_pair_post(void *sems, int i) {
+  fsem_post(&((struct padded_fsem *)sems)[i].sem);
+}
+
+static void fsem_pair_wait(void *sems, int i) {
+  fsem_wait(&((struct padded_fsem *)sems)[i].sem);
+}
+
+static void fsem_pair_timedwait(void *sems, int i) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ts.tv_sec += 10;
+  if (fsem_timedwait(&((struct padded_fsem *)sems)[i].sem, &ts) == -1) {
+    fprintf(stderr, "fsem_timedwait timed out\n");
+    _exit(1);
+  }
+}
+
+static const struct sem_mode sem_modes[] = {
+  { "futex-sem", plain_init, plain_post, plain_wait, 0 },
+  { "fsem", fsem_pair_init, fsem_pair_post, fsem_pair_wait, 0 },
+  { "fsem-spin", fsem_pair_init, fsem_pair_post, fsem_pair_wait, FSEM_SPIN },
+  { "fsem-timed", fsem_pair_init, fsem_pair_post, fsem_pair_timedwait, FSEM_SPIN },
+};
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+int sem_bench(unsigned rounds) {
+  size_t len = 2 * sizeof(struct padded_fsem);
+  void *sems = shared_alloc(len);
+  double *samples = calloc(rounds, sizeof(*samples));
+  if (!sems || !samples) {
+    return 1;
+  }
+  printf("mode,spin,rounds,mean_ns,p50_ns,p99_ns\n");
+  for (size_t m = 0; m < sizeof(sem_modes) / sizeof(sem_modes[0]); ++m) {
+    const struct sem_mode *mode = &sem_modes[m];
+    mode->init(sems, mode->spin);
+    pid_t pid = fork();
+    if (pid == -1) {
+      fprintf(stderr, "fork failed with errno %d\n", errno);
+      return 1;
+    }
+    if (pid == 0) {
+      for (unsigned i = 0; i < rounds; ++i) {
+        mode->wait(sems, 0);
+        mode->post(sems, 1);
+      }
+      _exit(0);
+    }
+    double total = 0;
+    for (unsigned i = 0; i < rounds; ++i) {
+      double t0 = now_sec();
+      mode->post(sems, 0);
+      mode->wait(sems, 1);
+      // a round trip is two handoffs
+      samples[i] = (now_sec() - t0) / 2 * 1e9;
+      total += samples[i];
+    }
+    waitpid(pid, NULL, 0);
+    qsort(samples, rounds, sizeof(*samples), cmp_double);
+    printf("%s,%u,%u,%.0f,%.0f,%.0f\n", mode->name, mode->spin, rounds, total / rounds,
+           samples[rounds / 2], samples[(size_t)(rounds * 0.99)]);
+  }
+  free(samples);
+  munmap(sems, len);
+  return 0;
+}
+
+// log-linear latency histogram in ns: exact below 16, above that 16 buckets
+// per power of two, so percentiles are within ~6%
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+
+struct hist {
+  uint64_t count[64 * HIST_SUB];
+  uint64_t total;
+};
+
+static void hist_add(struct hist *h, uint64_t v) {
+  size_t idx = v;
+  if (v >= HIST_SUB) {
+    int e = 63 - __builtin_clzll(v);
+    idx = (size_t)(e - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+  }
+  h->count[idx]++;
+  h->total++;
+}
+
+// smallest value of the bucket holding the q-th quantile
+static uint64_t hist_quantile(const struct hist *h, double q) {
+  uint64_t target = q * h->total;
+  uint64_t seen = 0;
+  for (size_t idx = 0; idx < 64 * HIST_SUB; ++idx) {
+    seen += h->count[idx];
+    if (seen > target) {
+      if (idx < HIST_SUB) {
+        return idx;
+      }
+      int e = idx / HIST_SUB + HIST_SUB_BITS - 1;
+      return (uint64_t)(HIST_SUB + idx % HIST_SUB) << (e - HIST_SUB_BITS);
+    }
+  }
+  return 0;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// queue under test, the batch operations move between 1 and n items
+struct queue_ops {
+  const char *name;
+  size_t (*size)(uint32_t cap);
+  int (*init)(void *queue, uint32_t cap);
+  int (*put_many)(void *queue, void **items, int n);
+  int (*get_many)(void *queue, void **items, int n);
+};
+
+static size_t bbuf_size_op(uint32_t cap) {
+  return sizeof(BoundedBuffer);
+}
+
+static int bbuf_init_op(void *queue, uint32_t cap) {
+  bbuf_init(queue);
+  return 0;
+}
+
+static int bbuf_put_op(void *queue, void **items, int n) {
+  return bbuf_put_many(queue, items, n);
+}
+
+static int bbuf_get_op(void *queue, void **items, int n) {
+  return bbuf_get_many(queue, items, n);
+}
+
+static size_t spsc_size_op(uint32_t cap) {
+  return spsc_size(cap);
+}
+
+static int spsc_init_op(void *queue, uint32_t cap) {
+  return spsc_init(queue, cap);
+}
+
+static int spsc_put_op(void *queue, void **items, int n) {
+  return spsc_put_many(queue, items, n);
+}
+
+static int spsc_get_op(void *queue, void **items, int n) {
+  return spsc_get_many(queue, items, n);
+}
+
+static size_t mpmc_size_op(uint32_t cap) {
+  return mpmc_size(cap);
+}
+
+static int mpmc_init_op(void *queue, uint32_t cap) {
+  return mpmc_init(queue, cap);
+}
+
+// the MPMC queue has no batch operations, a batch is n single puts
+static int mpmc_put_op(void *queue, void **items, int n) {
+  for (int i = 0; i < n; ++i) {
+    mpmc_put(queue, items[i]);
+  }
+  return n;
+}
+
+static int mpmc_get_op(void *queue, void **items, int n) {
+  items[0] = mpmc_get(queue);
+  int k = 1;
+  while (k < n && mpmc_try_get(queue, &items[k])) {
+    k++;
+  }
+  return k;
+}
+
+static const struct queue_ops queue_kinds[] = {
+  { "bbuf", bbuf_size_op, bbuf_init_op, bbuf_put_op, bbuf_get_op },
+  { "spsc", spsc_size_op, spsc_init_op, spsc_put_op, spsc_get_op },
+  { "mpmc", mpmc_size_op, mpmc_init_op, mpmc_put_op, mpmc_get_op },
+};
+
+// messages of the paced pass that measures handoff latency
+#define IPC_HANDOFF_MSGS 10000
+
+// control block shared by the parent and both sides of a run
+struct ipc_run {
+  atomic_int ready;
+  atomic_int go;
+  atomic_uint acked;          // messages the consumer is done with
+  uint64_t start_ns;
+  uint64_t end_ns;
+  uint64_t received;
+  uint64_t checksum;
+  struct hist hist;
+};
+
+static void pin_cpu(int cpu) {
+  if (cpu < 0) {
+    return;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+    fprintf(stderr, "pinning to CPU %d failed with errno %d\n", cpu, errno);
+  }
+}
+
+static void wait_go(struct ipc_run *run) {
+  atomic_fetch_add(&run->ready, 1);
+  while (!atomic_load(&run->go)) {
+    cpu_relax();
+  }
+}
+
+// paced: every batch waits until the consumer took the previous one, the
+// queue is empty whenever a message is put and its latency is the handoff
+// alone. Otherwise the producer runs flat out and the queue stays full.
+static void ipc_produce(const struct queue_ops *ops, void *queue, struct arena *arena,
+                        uint32_t nmsgs, int batch, uint32_t payload, struct ipc_run *run,
+                        bool paced) {
+  void *items[IPC_MAX_BATCH];
+  uint32_t sent = 0;
+  while (sent < nmsgs) {
+    while (paced && atomic_load(&run->acked) < sent) {
+      sched_yield();
+    }
+    int k = nmsgs - sent < (uint32_t)batch ? (int)(nmsgs - sent) : batch;
+    for (int i = 0; i < k; ++i) {
+      void *buf;
+      arena_handle h;
+      while ((h = arena_reserve(arena, payload, &buf)) == ARENA_NULL) {
+        sched_yield();
+      }
+      memset((uint8_t *)buf + sizeof(uint64_t), (uint8_t)(sent + i), payload - sizeof(uint64_t));
+      *(uint64_t *)buf = now_ns();
+      arena_commit(arena, h, payload);
+      items[i] = (void *)(uintptr_t)h;
+    }
+    // the queue may take fewer than k, hand over the rest in later rounds
+    for (int done = 0; done < k;) {
+      done += ops->put_many(queue, items + done, k - done);
+    }
+    sent += k;
+  }
+  void *end = (void *)(uintptr_t)ARENA_NULL;
+  while (ops->put_many(queue, &end, 1) == 0)
+    ;
+}
+
+static void ipc_consume(const struct queue_ops *ops, void *queue, struct arena *arena,
+                        int batch, struct ipc_run *run, bool paced) {
+  void *items[IPC_MAX_BATCH];
+  uint64_t sum = 0;
+  for (;;) {
+    int k = ops->get_many(queue, items, batch);
+    uint64_t now = now_ns();
+    for (int i = 0; i < k; ++i) {
+      arena_handle h = (uintptr_t)items[i];
+      if (h == ARENA_NULL) {
+        run->end_ns = now;
+        run->checksum = sum;
+        return;
+      }
+      size_t len;
+      const uint8_t *msg = arena_consume(arena, h, &len);
+      uint64_t sent_ns = *(const uint64_t *)msg;
+      if (paced) {
+        hist_add(&run->hist, now > sent_ns ? now - sent_ns : 0);
+      }
+      run->received++;
+      // read the whole payload like a real consumer would
+      for (size_t j = sizeof(uint64_t); j < len; j += sizeof(uint64_t)) {
+        sum += *(const uint64_t *)(msg + j);
+      }
+      arena_release(arena, h);
+    }
+    atomic_fetch_add(&run->acked, k);
+  }
+}
+
+// one producer and one consumer process pass nmsgs messages, returns -1 if
+// they couldn't be started
+static int ipc_pass(const struct queue_ops *ops, void *queue, struct arena *arena,
+                    struct ipc_run *run, const struct ipc_sweep *sweep, uint32_t nmsgs, int batch,
+                    uint32_t payload, bool paced) {
+  memset(run, 0, sizeof(*run));
+  pid_t pids[2];
+  for (int side = 0; side < 2; ++side) {
+    pids[side] = fork();
+    if (pids[side] == -1) {
+      fprintf(stderr, "fork failed with errno %d\n", errno);
+      // the producer would wait for the go signal forever
+      if (side == 1) {
+        kill(pids[0], SIGKILL);
+        waitpid(pids[0], NULL, 0);
+      }
+      return -1;
+    }
+    if (pids[side] == 0) {
+      pin_cpu(side == 0 ? sweep->prod_cpu : sweep->cons_cpu);
+      wait_go(run);
+      if (side == 0) {
+        ipc_produce(ops, queue, arena, nmsgs, batch, payload, run, paced);
+      } else {
+        ipc_consume(ops, queue, arena, batch, run, paced);
+      }
+      _exit(0);
+    }
+  }
+  while (atomic_load(&run->ready) < 2) {
+    sched_yield();
+  }
+  run->start_ns = now_ns();
+  atomic_store(&run->go, 1);
+  waitpid(pids[0], NULL, 0);
+  waitpid(pids[1], NULL, 0);
+  return 0;
+}
+
+static int ipc_run_one(const struct queue_ops *ops, uint32_t cap, int batch, uint32_t payload,
+                       const struct ipc_sweep *sweep) {
+  size_t qlen = (ops->size(cap) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+  uint32_t nslots = cap + 2 * batch + 2;
+  size_t len = sizeof(struct ipc_run) + CACHE_LINE + qlen + arena_size(nslots);
+  uint8_t *mem = shared_alloc(len);
+  if (!mem) {
+    return 1;
+  }
+  struct ipc_run *run = (struct ipc_run *)mem;
+  void *queue = mem + ((sizeof(struct ipc_run) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1));
+  struct arena *arena = (struct arena *)((uint8_t *)queue + qlen);
+  if (ops->init(queue, cap) == -1) {
+    fprintf(stderr, "%s: invalid capacity %u\n", ops->name, cap);
+    munmap(mem, len);
+    return 1;
+  }
+  arena_init(arena, nslots);
+
+  // saturated pass for throughput, its latencies would mostly be the time
+  // a message sat in the full queue, so they are taken from a paced pass
+  if (ipc_pass(ops, queue, arena, run, sweep, sweep->nmsgs, batch, payload, false) == -1) {
+    munmap(mem, len);
+    return 1;
+  }
+  double secs = (run->end_ns - run->start_ns) / 1e9;
+  uint64_t received = run->received;
+  double rate = received / secs;
+  uint32_t nhandoff = sweep->nmsgs < IPC_HANDOFF_MSGS ? sweep->nmsgs : IPC_HANDOFF_MSGS;
+  if (ipc_pass(ops, queue, arena, run, sweep, nhandoff, batch, payload, true) == -1) {
+    munmap(mem, len);
+    return 1;
+  }
+  printf("%s,%u,%d,%u,%lu,%.0f,%lu,%lu,%lu\n", ops->name,
+         ops == &queue_kinds[0] ? BOUNDED_BUFFER_LEN : cap, batch, payload, received, rate,
+         hist_quantile(&run->hist, 0.5), hist_quantile(&run->hist, 0.99),
+         hist_quantile(&run->hist, 0.999));
+  fflush(stdout);
+  int rc = received != sweep->nmsgs || run->received != nhandoff;
+  munmap(mem, len);
+  return rc;
+}
+
+int ipc_bench(const struct ipc_sweep *sweep) {
+  printf("queue,capacity,batch,payload,messages,msgs_per_sec,handoff_p50_ns,handoff_p99_ns,handoff_p999_ns\n");
+  int rc = 0;
+  for (int q = 0; q < sweep->nqueues; ++q) {
+    const struct queue_ops *ops = NULL;
+    for (size_t k = 0; k < sizeof(queue_kinds) / sizeof(queue_kinds[0]); ++k) {
+      if (strcmp(queue_kinds[k].name, sweep->queues[q]) == 0) {
+        ops = &queue_kinds[k];
+      }
+    }
+    if (!ops) {
+      fprintf(stderr, "unknown queue %s\n", sweep->queues[q]);
+      return 1;
+    }
+    // the bounded buffer's capacity is fixed, don't repeat it per cap
+    int ncaps = ops == &queue_kinds[0] ? 1 : sweep->ncaps;
+    for (int c = 0; c < ncaps; ++c) {
+      for (int b = 0; b < sweep->nbatches; ++b) {
+        for (int p = 0; p < sweep->npayloads; ++p) {
+          rc |= ipc_run_one(ops, sweep->caps[c], sweep->batches[b], sweep->payloads[p], sweep);
+        }
+      }
+    }
+  }
+  return rc;
+}
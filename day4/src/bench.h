@@ -0,0 +1,47 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+// nprod producer and ncons consumer processes move n items per producer
+// through an MPMC queue of cap slots. Every item is checked to arrive
+// exactly once and, per consumer, in its producer's order. Prints the
+// outcome and throughput as CSV, returns 1 if anything was lost or
+// duplicated.
+int mpmc_stress(unsigned nprod, unsigned ncons, uint32_t n, uint32_t cap);
+
+// two processes ping-pong over a pair of semaphores for rounds round
+// trips, once per waiting mode (plain futex semaphore, fsem without and
+// with spinning, fsem with a timed wait), and print handoff latency as CSV
+int sem_bench(unsigned rounds);
+
+#define SWEEP_MAX 16
+#define IPC_MAX_BATCH 256
+
+// parameter sweep of ipc_bench, every combination of the listed values is
+// run for each queue. A CPU of -1 leaves that side unpinned.
+struct ipc_sweep {
+  const char *queues[3];     // "bbuf", "spsc", "mpmc"
+  int nqueues;
+  uint32_t caps[SWEEP_MAX];
+  int ncaps;
+  int batches[SWEEP_MAX];    // 1 to IPC_MAX_BATCH
+  int nbatches;
+  uint32_t payloads[SWEEP_MAX]; // bytes per message, 8 to 4096
+  int npayloads;
+  uint32_t nmsgs;
+  int prod_cpu;
+  int cons_cpu;
+};
+
+// one producer and one consumer process, pinned to the given CPUs, pass
+// nmsgs messages carried in a shared payload arena through each queue.
+// Messages per second come from a pass with the producer running flat out.
+// Handoff latency, producer write to consumer read, comes from a second
+// pass in which each batch waits for the previous one to be consumed, so
+// time spent queued behind other messages isn't counted. Both are printed
+// as CSV. The semaphore BoundedBuffer has a fixed capacity of
+// BOUNDED_BUFFER_LEN and ignores caps.
+int ipc_bench(const struct ipc_sweep *sweep);
+
+#endif
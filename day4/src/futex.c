@@ -0,0 +1,27 @@
+#define _GNU_SOURCE
+#include "futex.h"
+
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#ifndef SYS_futex_waitv
+#define SYS_futex_waitv 449
+#endif
+
+int futex(atomic_int *uaddr, int op, uint32_t val, struct timespec *ts,
+          uint32_t *uaddr2, uint32_t val3) {
+  return syscall(SYS_futex, uaddr, op, val, ts, uaddr2, val3);
+}
+
+int futex_wake(atomic_int *uaddr, int nr) {
+  return futex(uaddr, FUTEX_WAKE, nr, NULL, NULL, 0);
+}
+
+int futex_wait(atomic_int *uaddr, int val) {
+  return futex(uaddr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+int futex_waitv(struct futex_waitv *waiters, unsigned n, struct timespec *timeout) {
+  return syscall(SYS_futex_waitv, waiters, n, 0, timeout, CLOCK_MONOTONIC);
+}
@@ -0,0 +1,21 @@
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+// the futex words live in MAP_SHARED memory, so none of these use the
+// FUTEX_PRIVATE_FLAG variants
+int futex(atomic_int *uaddr, int op, uint32_t val, struct timespec *ts,
+          uint32_t *uaddr2, uint32_t val3);
+int futex_wake(atomic_int *uaddr, int nr);
+int futex_wait(atomic_int *uaddr, int val);
+
+struct futex_waitv;
+
+// sleeps until any of the n futexes is woken or no longer holds its
+// expected value (Linux 5.16+). timeout is absolute CLOCK_MONOTONIC.
+int futex_waitv(struct futex_waitv *waiters, unsigned n, struct timespec *timeout);
+
+#endif
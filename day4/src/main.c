@@ -15,91 +15,317 @@
 #include <sys/wait.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sched.h>
+
+#include "arena.h"
+#include "bbuf.h"
+#include "bench.h"
+#include "futex.h"
+#include "sem.h"
+#include "spsc.h"
 
-#define NR_WAKE_UP 1
 #define PAGE_SIZE 4096
 
-static int futex(atomic_int *uaddr, int op, uint32_t val, struct timespec *ts,
-          uint32_t *uaddr2, uint32_t val3) {
-  return syscall(SYS_futex, uaddr, op, val, ts, uaddr2, val3);
-}
+static char *demo_data[] = {
+  "hello", "world", "from", "the", "child", "process"
+};
 
-static int futex_wake(atomic_int *uaddr, int nr) {
-  return futex(uaddr, FUTEX_WAKE, nr, NULL, NULL, 0);
-}
+// same exchange as the bounded buffer demo over an SPSC ring of cap slots,
+// a NULL item ends the stream
+static int spsc_demo(uint32_t cap) {
+  size_t len = (spsc_size(cap) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+  struct spsc *ring = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+  if (ring == MAP_FAILED) {
+    fprintf(stderr, "failed to create shared memory area\n");
+    fprintf(stderr, "mmap errno is %d\n", errno);
+    return 1;
+  }
+  if (spsc_init(ring, cap) == -1) {
+    fprintf(stderr, "ring capacity %u is not a power of two\n", cap);
+    return 1;
+  }
 
-static int futex_wait(atomic_int *uaddr, int val) {
-  return futex(uaddr, FUTEX_WAIT, val, NULL, NULL, 0);
+  pid_t child = fork();
+  if (child == -1) {
+    fprintf(stderr, "fork failed with errno %d\n", errno);
+    return 1;
+  }
+  if (child == 0) {
+    for (size_t i = 0; i < sizeof(demo_data) / sizeof(demo_data[0]); ++i) {
+      spsc_put(ring, demo_data[i]);
+    }
+    spsc_put(ring, NULL);
+    _exit(0);
+  }
+  char *str;
+  while ((str = spsc_get(ring)) != NULL) {
+    printf("received: %s\n", str);
+  }
+  waitpid(child, NULL, 0);
+  munmap(ring, len);
+  return 0;
 }
 
-void sem_init(atomic_int *sem, unsigned int initval) {
-  atomic_init(sem, initval);
-}
+// the demo strings again, but written into a payload arena and passed as
+// handles. Both sides map the shared memfd on their own after the fork,
+// nothing but offsets into it crosses the ring.
+static int arena_demo(uint32_t nslots) {
+  uint32_t cap = 4;
+  size_t ring_len = (spsc_size(cap) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+  size_t len = ring_len + arena_size(nslots);
+  int fd = memfd_create("arena", 0);
+  if (fd == -1 || ftruncate(fd, len) == -1) {
+    fprintf(stderr, "failed to create shared memory file, errno %d\n", errno);
+    return 1;
+  }
+  uint8_t *smem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (smem == MAP_FAILED) {
+    fprintf(stderr, "failed to map shared memory, errno %d\n", errno);
+    return 1;
+  }
+  spsc_init((struct spsc *)smem, cap);
+  arena_init((struct arena *)(smem + ring_len), nslots);
+  munmap(smem, len);
 
-void sem_incr(atomic_int *sem) {
-  bool succ = false;
-  while (!succ) {
-    int cur = atomic_load(sem);
-    succ = atomic_compare_exchange_strong(sem, &cur, cur + 1);
-    cur = atomic_load(sem);
-    if (cur > 0) {
-      futex_wake(sem, NR_WAKE_UP);
+  pid_t child = fork();
+  if (child == -1) {
+    fprintf(stderr, "fork failed with errno %d\n", errno);
+    return 1;
+  }
+  smem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (smem == MAP_FAILED) {
+    fprintf(stderr, "failed to map shared memory, errno %d\n", errno);
+    return 1;
+  }
+  struct spsc *ring = (struct spsc *)smem;
+  struct arena *arena = (struct arena *)(smem + ring_len);
+
+  if (child == 0) {
+    printf("producer maps the arena at %p\n", (void *)arena);
+    fflush(stdout);
+    for (size_t i = 0; i < sizeof(demo_data) / sizeof(demo_data[0]); ++i) {
+      void *buf;
+      arena_handle h;
+      while ((h = arena_reserve(arena, 64, &buf)) == ARENA_NULL) {
+        sched_yield();
+      }
+      int n = snprintf(buf, 64, "message %zu: %s", i, demo_data[i]);
+      arena_commit(arena, h, n + 1);
+      spsc_put(ring, (void *)(uintptr_t)h);
     }
+    spsc_put(ring, (void *)(uintptr_t)ARENA_NULL);
+    _exit(0);
+  }
+  printf("consumer maps the arena at %p\n", (void *)arena);
+  arena_handle h;
+  while ((h = (uintptr_t)spsc_get(ring)) != ARENA_NULL) {
+    size_t msglen;
+    const char *msg = arena_consume(arena, h, &msglen);
+    printf("received: %s (handle %lu, %zu bytes)\n", msg, h, msglen);
+    arena_release(arena, h);
   }
+  waitpid(child, NULL, 0);
+  munmap(smem, len);
+  close(fd);
+  return 0;
 }
 
-void sem_decr(atomic_int *sem) {
-  bool succ = false;
-  while (!succ) {
-    int cur = atomic_load(sem);
-    if (cur > 0) {
-      succ = atomic_compare_exchange_strong(sem, &cur, cur - 1);
-    } else {
-      futex_wait(sem, 0);
+// nprod producers each feed their own bounded buffer in bursts of up to
+// batch items, a single consumer serves all of them by waiting on every
+// buffer at once and draining whichever has data
+static int multi_demo(unsigned nprod, unsigned n, int batch) {
+  size_t len = (nprod * sizeof(BoundedBuffer) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+  BoundedBuffer *bufs = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+  BoundedBuffer **active = calloc(nprod, sizeof(*active));
+  void **items = calloc(batch, sizeof(*items));
+  if (bufs == MAP_FAILED || !active || !items) {
+    fprintf(stderr, "failed to allocate buffers\n");
+    return 1;
+  }
+  for (unsigned p = 0; p < nprod; ++p) {
+    bbuf_init(&bufs[p]);
+    active[p] = &bufs[p];
+  }
+
+  for (unsigned p = 0; p < nprod; ++p) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      fprintf(stderr, "fork failed with errno %d\n", errno);
+      return 1;
+    }
+    if (pid == 0) {
+      // item i + 1 so that NULL stays the end marker
+      unsigned sent = 0;
+      while (sent < n) {
+        int k = n - sent < (unsigned)batch ? n - sent : batch;
+        for (int i = 0; i < k; ++i) {
+          items[i] = (void *)(uintptr_t)(sent + i + 1);
+        }
+        sent += bbuf_put_many(&bufs[p], items, k);
+      }
+      bbuf_put(&bufs[p], NULL);
+      _exit(0);
     }
   }
+
+  unsigned nactive = nprod;
+  unsigned long received = 0, rounds = 0;
+  while (nactive > 0) {
+    int i = bbuf_wait_any(active, nactive);
+    if (i == -1) {
+      return 1;
+    }
+    int k = bbuf_get_many(active[i], items, batch);
+    rounds++;
+    for (int j = 0; j < k; ++j) {
+      if (items[j] == NULL) {
+        active[i] = active[--nactive];
+        break;
+      }
+      received++;
+    }
+  }
+  while (wait(NULL) > 0)
+    ;
+  printf("received %lu of %lu items from %u producers in %lu rounds, %.2f items per round\n",
+         received, (unsigned long)nprod * n, nprod, rounds, (double)received / rounds);
+  free(items);
+  free(active);
+  munmap(bufs, len);
+  return received != (unsigned long)nprod * n;
 }
 
-#define BOUNDED_BUFFER_LEN 3
-
-typedef struct {
-  atomic_int slots;
-  atomic_int elements;
-  atomic_int lock; 
-  uint32_t read_idx;
-  uint32_t write_idx;
-  void *data[BOUNDED_BUFFER_LEN];
-} BoundedBuffer;
-
-void bbuf_init(BoundedBuffer *buffer) {
-  sem_init(&buffer->slots, BOUNDED_BUFFER_LEN);
-  sem_init(&buffer->elements, 0);
-  sem_init(&buffer->lock, 1);
-  buffer->write_idx = 0;
-  buffer->read_idx = 0;
+// MPMC stress run with the given process counts, or a sweep of
+// nprod = ncons from 1 up to the number of online CPUs
+static int mpmc_mode(int argc, char **argv) {
+  unsigned nprod = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+  unsigned ncons = argc > 3 ? strtoul(argv[3], NULL, 10) : nprod;
+  uint32_t n = argc > 4 ? strtoul(argv[4], NULL, 10) : 1000000;
+  uint32_t cap = argc > 5 ? strtoul(argv[5], NULL, 10) : 1024;
+  printf("producers,consumers,capacity,items,lost,duplicated,reordered,items_per_sec\n");
+  if (nprod > 0) {
+    return mpmc_stress(nprod, ncons > 0 ? ncons : 1, n, cap);
+  }
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int rc = 0;
+  for (long k = 1; k <= ncpus; ++k) {
+    rc |= mpmc_stress(k, k, n, cap);
+  }
+  return rc;
 }
 
-void bbuf_put(BoundedBuffer *buffer, void *data) {
-  sem_decr(&buffer->slots);
-  sem_decr(&buffer->lock);
-  buffer->data[buffer->write_idx] = data;
-  buffer->write_idx = (buffer->write_idx + 1) % BOUNDED_BUFFER_LEN;
-  sem_incr(&buffer->lock);
-  sem_incr(&buffer->elements);
+// parses a comma separated list of at most SWEEP_MAX numbers
+static int parse_list(const char *str, uint32_t *vals) {
+  int n = 0;
+  char *end;
+  do {
+    if (n == SWEEP_MAX) {
+      return -1;
+    }
+    vals[n++] = strtoul(str, &end, 10);
+    if (end == str) {
+      return -1;
+    }
+    str = end + 1;
+  } while (*end == ',');
+  return *end == '\0' ? n : -1;
 }
 
-void *bbuf_get(BoundedBuffer *buffer) {
-  void *ret = NULL;
-  sem_decr(&buffer->elements);
-  sem_decr(&buffer->lock);
-  ret = buffer->data[buffer->read_idx];
-  buffer->read_idx = (buffer->read_idx + 1) % BOUNDED_BUFFER_LEN;
-  sem_incr(&buffer->lock);
-  sem_incr(&buffer->slots);
-  return ret;
+// bench [-q QUEUES] [-c CAPS] [-b BATCHES] [-s PAYLOADS] [-n MSGS] [-p CPU] [-C CPU]
+static int bench_mode(int argc, char **argv) {
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  struct ipc_sweep sweep = {
+    .queues = { "bbuf", "spsc", "mpmc" },
+    .nqueues = 3,
+    .caps = { 64, 1024 },
+    .ncaps = 2,
+    .batches = { 1, 16 },
+    .nbatches = 2,
+    .payloads = { 64, 1024 },
+    .npayloads = 2,
+    .nmsgs = 200000,
+    .prod_cpu = 0,
+    .cons_cpu = ncpus > 1 ? 1 : 0,
+  };
+  uint32_t batches[SWEEP_MAX];
+  int opt;
+  while ((opt = getopt(argc, argv, "q:c:b:s:n:p:C:")) != -1) {
+    switch (opt) {
+      case 'q': {
+        sweep.nqueues = 0;
+        for (char *q = strtok(optarg, ","); q; q = strtok(NULL, ",")) {
+          if (sweep.nqueues == 3) {
+            fprintf(stderr, "-q takes at most 3 queues (bbuf, spsc, mpmc)\n");
+            return 1;
+          }
+          sweep.queues[sweep.nqueues++] = q;
+        }
+        break;
+      }
+      case 'c':
+        sweep.ncaps = parse_list(optarg, sweep.caps);
+        break;
+      case 'b':
+        sweep.nbatches = parse_list(optarg, batches);
+        for (int i = 0; i < sweep.nbatches; ++i) {
+          sweep.batches[i] = batches[i];
+          if (batches[i] < 1 || batches[i] > IPC_MAX_BATCH) {
+            sweep.nbatches = -1;
+          }
+        }
+        break;
+      case 's':
+        sweep.npayloads = parse_list(optarg, sweep.payloads);
+        for (int i = 0; i < sweep.npayloads; ++i) {
+          if (sweep.payloads[i] < sizeof(uint64_t) || sweep.payloads[i] > 4096) {
+            sweep.npayloads = -1;
+          }
+        }
+        break;
+      case 'n':
+        sweep.nmsgs = strtoul(optarg, NULL, 10);
+        break;
+      case 'p':
+        sweep.prod_cpu = strtol(optarg, NULL, 10);
+        break;
+      case 'C':
+        sweep.cons_cpu = strtol(optarg, NULL, 10);
+        break;
+      default:
+        return 1;
+    }
+  }
+  if (sweep.ncaps <= 0 || sweep.nbatches <= 0 || sweep.npayloads <= 0) {
+    fprintf(stderr, "lists take up to %d values, batches 1 to %d, payloads 8 to 4096 bytes\n",
+            SWEEP_MAX, IPC_MAX_BATCH);
+    return 1;
+  }
+  return ipc_bench(&sweep);
 }
 
 int main(int argc, char **argv) {
+  if (argc > 1 && strncmp(argv[1], "spsc", 5) == 0) {
+    return spsc_demo(argc > 2 ? strtoul(argv[2], NULL, 10) : 4);
+  }
+  if (argc > 1 && strncmp(argv[1], "mpmc", 5) == 0) {
+    return mpmc_mode(argc, argv);
+  }
+  if (argc > 1 && strncmp(argv[1], "multi", 6) == 0) {
+    unsigned nprod = argc > 2 ? strtoul(argv[2], NULL, 10) : 4;
+    unsigned n = argc > 3 ? strtoul(argv[3], NULL, 10) : 100000;
+    int batch = argc > 4 ? strtol(argv[4], NULL, 10) : BOUNDED_BUFFER_LEN;
+    return multi_demo(nprod, n, batch > 0 ? batch : 1);
+  }
+  if (argc > 1 && strncmp(argv[1], "arena", 6) == 0) {
+    return arena_demo(argc > 2 ? strtoul(argv[2], NULL, 10) : 4);
+  }
+  if (argc > 1 && strncmp(argv[1], "bench", 6) == 0) {
+    return bench_mode(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strncmp(argv[1], "sembench", 9) == 0) {
+    return sem_bench(argc > 2 ? strtoul(argv[2], NULL, 10) : 100000);
+  }
+
   uint8_t *smem = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);  
   if (smem == MAP_FAILED) {
     fprintf(stderr, "failed to create shared memory area\n");
@@ -125,16 +351,13 @@ int main(int argc, char **argv) {
       printf("received: %s\n", str);
     }
   } else {
-    char *data[] = {
-      "hello", "world", "from", "the", "child", "process"
-    };
     sleep(1);
     bbuf_init(bbuf);
     sem_incr(wait_on_buff_init);
 
     int next = 0;
     while (next < 6) {
-      bbuf_put(bbuf, (void *)data[next++]);
+      bbuf_put(bbuf, (void *)demo_data[next++]);
     }
   }
   return 0;
@@ -0,0 +1,114 @@
+#include "mpmc.h"
+#include "futex.h"
+
+#include <string.h>
+
+size_t mpmc_size(uint32_t cap) {
+  return sizeof(struct mpmc) + cap * sizeof(struct mpmc_cell);
+}
+
+int mpmc_init(struct mpmc *queue, uint32_t cap) {
+  // with a single cell "full for lap n" and "free for lap n + 1" are the
+  // same sequence number
+  if (cap < 2 || (cap & (cap - 1)) != 0) {
+    return -1;
+  }
+  memset(queue, 0, sizeof(*queue));
+  queue->cap = cap;
+  queue->mask = cap - 1;
+  for (uint32_t i = 0; i < cap; ++i) {
+    atomic_init(&queue->cells[i].seq, i);
+    queue->cells[i].data = NULL;
+  }
+  return 0;
+}
+
+// after a successful put or get. The fence pairs with the one in wait_event:
+// either the waiter's retry sees our update, or we see it waiting.
+static void signal_event(atomic_int *event, atomic_int *waiters) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(waiters, memory_order_relaxed) > 0) {
+    atomic_fetch_add_explicit(event, 1, memory_order_relaxed);
+    futex_wake(event, 1);
+  }
+}
+
+bool mpmc_try_put(struct mpmc *queue, void *data) {
+  uint32_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+  struct mpmc_cell *cell;
+  for (;;) {
+    cell = &queue->cells[pos & queue->mask];
+    uint32_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    int32_t diff = (int32_t)(seq - pos);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // the cell still holds data from the previous lap
+      return false;
+    } else {
+      pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    }
+  }
+  cell->data = data;
+  atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+  signal_event(&queue->not_empty, &queue->cons_waiters);
+  return true;
+}
+
+bool mpmc_try_get(struct mpmc *queue, void **data) {
+  uint32_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+  struct mpmc_cell *cell;
+  for (;;) {
+    cell = &queue->cells[pos & queue->mask];
+    uint32_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    int32_t diff = (int32_t)(seq - (pos + 1));
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    }
+  }
+  *data = cell->data;
+  // free the cell for the producer one lap ahead
+  atomic_store_explicit(&cell->seq, pos + queue->cap, memory_order_release);
+  signal_event(&queue->not_full, &queue->prod_waiters);
+  return true;
+}
+
+void mpmc_put(struct mpmc *queue, void *data) {
+  while (!mpmc_try_put(queue, data)) {
+    int seen = atomic_load_explicit(&queue->not_full, memory_order_relaxed);
+    atomic_fetch_add_explicit(&queue->prod_waiters, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (mpmc_try_put(queue, data)) {
+      atomic_fetch_sub_explicit(&queue->prod_waiters, 1, memory_order_relaxed);
+      return;
+    }
+    futex_wait(&queue->not_full, seen);
+    atomic_fetch_sub_explicit(&queue->prod_waiters, 1, memory_order_relaxed);
+  }
+}
+
+void *mpmc_get(struct mpmc *queue) {
+  void *data;
+  while (!mpmc_try_get(queue, &data)) {
+    int seen = atomic_load_explicit(&queue->not_empty, memory_order_relaxed);
+    atomic_fetch_add_explicit(&queue->cons_waiters, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (mpmc_try_get(queue, &data)) {
+      atomic_fetch_sub_explicit(&queue->cons_waiters, 1, memory_order_relaxed);
+      return data;
+    }
+    futex_wait(&queue->not_empty, seen);
+    atomic_fetch_sub_explicit(&queue->cons_waiters, 1, memory_order_relaxed);
+  }
+  return data;
+}
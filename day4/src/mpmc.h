@@ -0,0 +1,48 @@
+#ifndef MPMC_H
+#define MPMC_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "spsc.h"
+
+// a slot is free for the producer claiming position pos when seq == pos,
+// and holds data for the consumer claiming pos when seq == pos + 1
+struct mpmc_cell {
+  atomic_uint seq;
+  void *data;
+};
+
+// bounded queue for any number of producer and consumer processes, after
+// Vyukov's sequence-numbered ring. Producers and consumers each race for a
+// position with one CAS on their own cache line, the cell's sequence number
+// then tells whether the claimed cell is ready. Blocked processes park on an
+// event counter that is only bumped, and only woken, while someone waits.
+struct mpmc {
+  _Alignas(CACHE_LINE) atomic_uint enqueue_pos;
+  _Alignas(CACHE_LINE) atomic_uint dequeue_pos;
+  _Alignas(CACHE_LINE) atomic_int not_full;   // futex word for producers
+  atomic_int prod_waiters;
+  _Alignas(CACHE_LINE) atomic_int not_empty;  // futex word for consumers
+  atomic_int cons_waiters;
+  _Alignas(CACHE_LINE) uint32_t cap;
+  uint32_t mask;
+  struct mpmc_cell cells[];
+};
+
+// bytes needed for a queue of cap slots, cap must be a power of two >= 2
+size_t mpmc_size(uint32_t cap);
+
+// returns -1 if cap is not a power of two >= 2
+int mpmc_init(struct mpmc *queue, uint32_t cap);
+
+bool mpmc_try_put(struct mpmc *queue, void *data);
+bool mpmc_try_get(struct mpmc *queue, void **data);
+
+// block while the queue is full / empty
+void mpmc_put(struct mpmc *queue, void *data);
+void *mpmc_get(struct mpmc *queue);
+
+#endif
@@ -0,0 +1,122 @@
+#define _GNU_SOURCE
+#include "sem.h"
+#include "futex.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <linux/futex.h>
+
+#define NR_WAKE_UP 1
+
+void sem_init(atomic_int *sem, unsigned int initval) {
+  atomic_init(sem, initval);
+}
+
+void sem_incr(atomic_int *sem) {
+  bool succ = false;
+  while (!succ) {
+    int cur = atomic_load(sem);
+    succ = atomic_compare_exchange_strong(sem, &cur, cur + 1);
+    cur = atomic_load(sem);
+    if (cur > 0) {
+      futex_wake(sem, NR_WAKE_UP);
+    }
+  }
+}
+
+void sem_decr(atomic_int *sem) {
+  bool succ = false;
+  while (!succ) {
+    int cur = atomic_load(sem);
+    if (cur > 0) {
+      succ = atomic_compare_exchange_strong(sem, &cur, cur - 1);
+    } else {
+      futex_wait(sem, 0);
+    }
+  }
+}
+
+
+int sem_decr_many(atomic_int *sem, int max) {
+  for (;;) {
+    int cur = atomic_load(sem);
+    if (cur > 0) {
+      int take = cur < max ? cur : max;
+      if (atomic_compare_exchange_strong(sem, &cur, cur - take)) {
+        return take;
+      }
+    } else {
+      futex_wait(sem, 0);
+    }
+  }
+}
+
+void sem_incr_many(atomic_int *sem, int n) {
+  atomic_fetch_add(sem, n);
+  futex_wake(sem, n);
+}
+
+static bool spin_allowed(void) {
+  static int ncpus = 0;
+  if (ncpus == 0) {
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  return ncpus > 1;
+}
+
+void fsem_init(struct fsem *sem, unsigned int initval, unsigned spin) {
+  atomic_init(&sem->value, initval);
+  atomic_init(&sem->waiters, 0);
+  sem->spin = spin;
+}
+
+void fsem_post(struct fsem *sem) {
+  // seq_cst pairs with the waiter's increment of waiters before its last
+  // trywait: either it sees the new value or we see it waiting
+  atomic_fetch_add(&sem->value, 1);
+  if (atomic_load(&sem->waiters) > 0) {
+    futex_wake(&sem->value, 1);
+  }
+}
+
+bool fsem_trywait(struct fsem *sem) {
+  int cur = atomic_load_explicit(&sem->value, memory_order_relaxed);
+  while (cur > 0) {
+    if (atomic_compare_exchange_weak_explicit(&sem->value, &cur, cur - 1, memory_order_acquire,
+                                              memory_order_relaxed)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int fsem_timedwait(struct fsem *sem, const struct timespec *abstime) {
+  if (spin_allowed()) {
+    for (unsigned i = 0; i < sem->spin; ++i) {
+      if (atomic_load_explicit(&sem->value, memory_order_relaxed) > 0 && fsem_trywait(sem)) {
+        return 0;
+      }
+      cpu_relax();
+    }
+  }
+  atomic_fetch_add(&sem->waiters, 1);
+  int rc = 0;
+  while (!fsem_trywait(sem)) {
+    // FUTEX_WAIT_BITSET takes an absolute timeout, so spurious wakeups and
+    // EINTR don't stretch the total wait
+    if (futex(&sem->value, FUTEX_WAIT_BITSET, 0, (struct timespec *)abstime, NULL,
+              FUTEX_BITSET_MATCH_ANY) == -1 && errno == ETIMEDOUT) {
+      rc = -1;
+      break;
+    }
+  }
+  atomic_fetch_sub(&sem->waiters, 1);
+  if (rc == -1) {
+    errno = ETIMEDOUT;
+  }
+  return rc;
+}
+
+void fsem_wait(struct fsem *sem) {
+  fsem_timedwait(sem, NULL);
+}
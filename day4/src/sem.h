@@ -0,0 +1,53 @@
+#ifndef SEM_H
+#define SEM_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+
+// plain futex semaphore, the counter itself is the futex word. sem_incr
+// wakes on every increment whether anybody sleeps or not.
+void sem_init(atomic_int *sem, unsigned int initval);
+void sem_incr(atomic_int *sem);
+void sem_decr(atomic_int *sem);
+
+// takes between 1 and max units at once, blocking while there are none,
+// and returns how many were taken
+int sem_decr_many(atomic_int *sem, int max);
+
+// adds n units with a single wake for up to n sleepers
+void sem_incr_many(atomic_int *sem, int n);
+
+// default number of pause iterations fsem_wait spins before it sleeps
+#define FSEM_SPIN 2000
+
+// semaphore that counts its sleepers, so posting only costs a syscall when
+// someone is asleep. Waiters first spin on the counter for a bounded number
+// of iterations, which on an otherwise idle peer usually catches the post
+// without ever sleeping. Spinning is skipped on a single CPU, where it only
+// delays the process that would post.
+struct fsem {
+  atomic_int value;     // futex word
+  atomic_int waiters;
+  unsigned spin;
+};
+
+void fsem_init(struct fsem *sem, unsigned int initval, unsigned spin);
+void fsem_post(struct fsem *sem);
+bool fsem_trywait(struct fsem *sem);
+void fsem_wait(struct fsem *sem);
+
+// like fsem_wait, but gives up at abstime (CLOCK_MONOTONIC, NULL waits
+// forever). Returns -1 with errno ETIMEDOUT in that case.
+int fsem_timedwait(struct fsem *sem, const struct timespec *abstime);
+
+// pause instruction for spin loops
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ volatile("yield");
+#endif
+}
+
+#endif
@@ -0,0 +1,125 @@
+#include "spsc.h"
+#include "futex.h"
+
+#include <string.h>
+
+size_t spsc_size(uint32_t cap) {
+  return sizeof(struct spsc) + cap * sizeof(void *);
+}
+
+int spsc_init(struct spsc *ring, uint32_t cap) {
+  if (cap == 0 || (cap & (cap - 1)) != 0) {
+    return -1;
+  }
+  memset(ring, 0, sizeof(*ring));
+  ring->cap = cap;
+  ring->mask = cap - 1;
+  return 0;
+}
+
+// called after publishing a new index value in word. The fence pairs with the
+// one in park(): either the sleeper sees the new index before it sleeps, or
+// we see its waiting flag.
+static void unpark(atomic_int *word, atomic_int *waiting) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(waiting, memory_order_relaxed)
+      && atomic_exchange_explicit(waiting, 0, memory_order_relaxed)) {
+    futex_wake(word, 1);
+  }
+}
+
+// sleeps until word no longer holds seen
+static void park(atomic_int *word, atomic_int *waiting, int seen) {
+  atomic_store_explicit(waiting, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  // the kernel compares again, so a change after this check isn't lost
+  if (atomic_load_explicit(word, memory_order_relaxed) == seen) {
+    futex_wait(word, seen);
+  }
+  atomic_store_explicit(waiting, 0, memory_order_relaxed);
+}
+
+bool spsc_try_put(struct spsc *ring, void *data) {
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  if (tail - ring->head_cache == ring->cap) {
+    ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - ring->head_cache == ring->cap) {
+      return false;
+    }
+  }
+  ring->data[tail & ring->mask] = data;
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  unpark(&ring->tail, &ring->cons_waiting);
+  return true;
+}
+
+bool spsc_try_get(struct spsc *ring, void **data) {
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head == ring->tail_cache) {
+    ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == ring->tail_cache) {
+      return false;
+    }
+  }
+  *data = ring->data[head & ring->mask];
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  unpark(&ring->head, &ring->prod_waiting);
+  return true;
+}
+
+void spsc_put(struct spsc *ring, void *data) {
+  while (!spsc_try_put(ring, data)) {
+    // full: wait for the consumer to move head past the cached value
+    park(&ring->head, &ring->prod_waiting, ring->head_cache);
+  }
+}
+
+void *spsc_get(struct spsc *ring) {
+  void *data;
+  while (!spsc_try_get(ring, &data)) {
+    park(&ring->tail, &ring->cons_waiting, ring->tail_cache);
+  }
+  return data;
+}
+
+int spsc_put_many(struct spsc *ring, void **data, int n) {
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  uint32_t room = ring->cap - (tail - ring->head_cache);
+  if (room < (uint32_t)n) {
+    ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+    room = ring->cap - (tail - ring->head_cache);
+  }
+  while (room == 0) {
+    park(&ring->head, &ring->prod_waiting, ring->head_cache);
+    ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+    room = ring->cap - (tail - ring->head_cache);
+  }
+  int k = room < (uint32_t)n ? (int)room : n;
+  for (int i = 0; i < k; ++i) {
+    ring->data[(tail + i) & ring->mask] = data[i];
+  }
+  atomic_store_explicit(&ring->tail, tail + k, memory_order_release);
+  unpark(&ring->tail, &ring->cons_waiting);
+  return k;
+}
+
+int spsc_get_many(struct spsc *ring, void **data, int n) {
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint32_t avail = ring->tail_cache - head;
+  if (avail < (uint32_t)n) {
+    ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    avail = ring->tail_cache - head;
+  }
+  while (avail == 0) {
+    park(&ring->tail, &ring->cons_waiting, ring->tail_cache);
+    ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    avail = ring->tail_cache - head;
+  }
+  int k = avail < (uint32_t)n ? (int)avail : n;
+  for (int i = 0; i < k; ++i) {
+    data[i] = ring->data[(head + i) & ring->mask];
+  }
+  atomic_store_explicit(&ring->head, head + k, memory_order_release);
+  unpark(&ring->head, &ring->prod_waiting);
+  return k;
+}
@@ -0,0 +1,53 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_LINE 64
+
+// lock-free ring for exactly one producer and one consumer process. head and
+// tail run freely and are only masked when indexing, so a full ring is
+// tail - head == cap. Each side owns one cache line: it writes its index
+// there and keeps a cached copy of the other side's index, so the lines only
+// bounce when that copy runs out of date. The futex is only touched to park
+// on a full or empty ring, and a wake costs a syscall only if the other
+// side announced that it is sleeping. Checking for that still takes a
+// seq_cst fence after every index update, so a put or get costs a release
+// store plus a full fence even when nobody sleeps.
+struct spsc {
+  // producer side
+  _Alignas(CACHE_LINE) atomic_int tail;  // futex word the consumer parks on
+  atomic_int cons_waiting;
+  uint32_t head_cache;
+  // consumer side
+  _Alignas(CACHE_LINE) atomic_int head;  // futex word the producer parks on
+  atomic_int prod_waiting;
+  uint32_t tail_cache;
+  _Alignas(CACHE_LINE) uint32_t cap;
+  uint32_t mask;
+  void *data[];
+};
+
+// bytes needed for a ring of cap slots, cap must be a power of two
+size_t spsc_size(uint32_t cap);
+
+// the ring must be placed in memory of at least spsc_size(cap) bytes, shared
+// between both processes. Returns -1 if cap is not a power of two.
+int spsc_init(struct spsc *ring, uint32_t cap);
+
+bool spsc_try_put(struct spsc *ring, void *data);
+bool spsc_try_get(struct spsc *ring, void **data);
+
+// block while the ring is full / empty
+void spsc_put(struct spsc *ring, void *data);
+void *spsc_get(struct spsc *ring);
+
+// move between 1 and n items with a single index update and at most one
+// wake, blocking until at least one fits / is there. Return the count.
+int spsc_put_many(struct spsc *ring, void **data, int n);
+int spsc_get_many(struct spsc *ring, void **data, int n);
+
+#endif
@@ -0,0 +1,156 @@
+#include "coalesce.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t path_hash(const char *path) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (const unsigned char *p = (const unsigned char *)path; *p; ++p) {
+    hash ^= *p;
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+int coalesce_init(struct coalescer *c, uint64_t window_ms, uint64_t now_ms) {
+  memset(c, 0, sizeof(*c));
+  c->nbuckets = 1024;
+  c->buckets = calloc(c->nbuckets, sizeof(*c->buckets));
+  if (!c->buckets) {
+    fprintf(stderr, "failed to allocate coalescing table\n");
+    return -1;
+  }
+  c->window_ms = window_ms;
+  c->tick_ms = (window_ms + 31) / 32;
+  if (c->tick_ms == 0) {
+    c->tick_ms = 1;
+  }
+  c->cur_tick = now_ms / c->tick_ms;
+  return 0;
+}
+
+static void drop(struct pending *p) {
+  free(p->path);
+  free(p);
+}
+
+void coalesce_free(struct coalescer *c) {
+  for (size_t i = 0; i < COALESCE_WHEEL; ++i) {
+    while (c->wheel[i]) {
+      struct pending *p = c->wheel[i];
+      c->wheel[i] = p->wnext;
+      drop(p);
+    }
+  }
+  free(c->buckets);
+  c->buckets = NULL;
+}
+
+static int grow(struct coalescer *c) {
+  size_t nbuckets = c->nbuckets * 2;
+  struct pending **buckets = calloc(nbuckets, sizeof(*buckets));
+  if (!buckets) {
+    return -1;
+  }
+  for (size_t i = 0; i < c->nbuckets; ++i) {
+    while (c->buckets[i]) {
+      struct pending *p = c->buckets[i];
+      c->buckets[i] = p->hnext;
+      p->hnext = buckets[p->hash & (nbuckets - 1)];
+      buckets[p->hash & (nbuckets - 1)] = p;
+    }
+  }
+  free(c->buckets);
+  c->buckets = buckets;
+  c->nbuckets = nbuckets;
+  return 0;
+}
+
+int coalesce_add(struct coalescer *c, const char *path, uint32_t mask, uint64_t now_ms) {
+  uint64_t hash = path_hash(path);
+  for (struct pending *p = c->buckets[hash & (c->nbuckets - 1)]; p; p = p->hnext) {
+    if (p->hash == hash && strcmp(p->path, path) == 0) {
+      p->mask |= mask;
+      p->count++;
+      return 0;
+    }
+  }
+  if (c->count >= c->nbuckets && grow(c) == -1) {
+    return -1;
+  }
+  struct pending *p = malloc(sizeof(*p));
+  char *copy = strdup(path);
+  if (!p || !copy) {
+    free(p);
+    free(copy);
+    return -1;
+  }
+  *p = (struct pending){
+    .path = copy,
+    .hash = hash,
+    .mask = mask,
+    .count = 1,
+    .expire_tick = (now_ms + c->window_ms + c->tick_ms - 1) / c->tick_ms,
+  };
+  size_t b = hash & (c->nbuckets - 1);
+  p->hnext = c->buckets[b];
+  c->buckets[b] = p;
+  // the window is at most 32 ticks, well within one turn of the wheel
+  size_t slot = p->expire_tick % COALESCE_WHEEL;
+  p->wnext = c->wheel[slot];
+  c->wheel[slot] = p;
+  c->count++;
+  return 0;
+}
+
+static void unhash(struct coalescer *c, struct pending *p) {
+  struct pending **pp = &c->buckets[p->hash & (c->nbuckets - 1)];
+  while (*pp != p) {
+    pp = &(*pp)->hnext;
+  }
+  *pp = p->hnext;
+  c->count--;
+}
+
+// emits the entries of one slot that are due at tick
+static void expire_slot(struct coalescer *c, size_t slot, uint64_t tick, coalesce_emit_fn emit,
+                        void *arg) {
+  struct pending **pp = &c->wheel[slot];
+  while (*pp) {
+    struct pending *p = *pp;
+    if (p->expire_tick > tick) {
+      pp = &p->wnext;
+      continue;
+    }
+    *pp = p->wnext;
+    unhash(c, p);
+    emit(p->path, p->mask, p->count, arg);
+    drop(p);
+  }
+}
+
+void coalesce_expire(struct coalescer *c, uint64_t now_ms, coalesce_emit_fn emit, void *arg) {
+  uint64_t now_tick = now_ms / c->tick_ms;
+  // after a long stall one turn of the wheel covers every slot
+  if (now_tick - c->cur_tick >= COALESCE_WHEEL) {
+    c->cur_tick = now_tick - COALESCE_WHEEL + 1;
+  }
+  for (; c->cur_tick <= now_tick; ++c->cur_tick) {
+    expire_slot(c, c->cur_tick % COALESCE_WHEEL, now_tick, emit, arg);
+  }
+}
+
+void coalesce_flush(struct coalescer *c, coalesce_emit_fn emit, void *arg) {
+  for (size_t i = 0; i < COALESCE_WHEEL; ++i) {
+    expire_slot(c, i, UINT64_MAX, emit, arg);
+  }
+}
+
+int coalesce_timeout(const struct coalescer *c, uint64_t now_ms) {
+  if (c->count == 0) {
+    return -1;
+  }
+  uint64_t next = c->cur_tick * c->tick_ms;
+  return next > now_ms ? (int)(next - now_ms) : 0;
+}
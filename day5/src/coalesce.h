@@ -0,0 +1,50 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define COALESCE_WHEEL 64
+
+// events of one path within the current window
+struct pending {
+  char *path;
+  uint64_t hash;
+  uint32_t mask;            // all event bits seen
+  uint32_t count;
+  uint64_t expire_tick;
+  struct pending *hnext;    // hash bucket chain
+  struct pending *wnext;    // timer wheel slot list
+};
+
+// merges events per path: the first event of a path opens a window of
+// window_ms, everything until it closes is or-ed into one record. Pending
+// paths live in a chained hash set for lookup and in a timer wheel of
+// COALESCE_WHEEL slots for expiry, each slot spans window_ms / 32.
+struct coalescer {
+  struct pending **buckets;
+  size_t nbuckets;          // power of two
+  size_t count;
+  struct pending *wheel[COALESCE_WHEEL];
+  uint64_t tick_ms;
+  uint64_t window_ms;
+  uint64_t cur_tick;        // next wheel slot to expire
+};
+
+typedef void (*coalesce_emit_fn)(const char *path, uint32_t mask, uint32_t count, void *arg);
+
+int coalesce_init(struct coalescer *c, uint64_t window_ms, uint64_t now_ms);
+void coalesce_free(struct coalescer *c);
+
+int coalesce_add(struct coalescer *c, const char *path, uint32_t mask, uint64_t now_ms);
+
+// emits and drops every record whose window closed by now_ms
+void coalesce_expire(struct coalescer *c, uint64_t now_ms, coalesce_emit_fn emit, void *arg);
+
+// emits all pending records regardless of their windows
+void coalesce_flush(struct coalescer *c, coalesce_emit_fn emit, void *arg);
+
+// ms until the next wheel slot is due, -1 if nothing is pending
+int coalesce_timeout(const struct coalescer *c, uint64_t now_ms);
+
+#endif
@@ -0,0 +1,146 @@
+#include "events.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#define ARRAY_SIZE(arr) (sizeof(arr)/sizeof(*(arr)))
+
+#define OUT_BUF_LEN (64 * 1024)
+
+struct event_flag {
+  uint32_t mask;
+  char *name;
+};
+
+// combined masks (IN_MOVE, IN_CLOSE) are covered by their single bits
+static const struct event_flag inotify_event_flags[] = {
+    {IN_ACCESS, "access"},
+    {IN_ATTRIB, "attrib"},
+    {IN_CLOSE_WRITE, "close_write"},
+    {IN_CLOSE_NOWRITE, "close_nowrite"},
+    {IN_CREATE, "create"},
+    {IN_DELETE, "delete"},
+    {IN_DELETE_SELF, "delete_self"},
+    {IN_MODIFY, "modify"},
+    {IN_MOVE_SELF, "move_self"},
+    {IN_MOVED_FROM, "move_from"},
+    {IN_MOVED_TO, "moved_to"},
+    {IN_OPEN, "open"},
+    {IN_MASK_ADD, "mask_add"},
+    {IN_IGNORED, "ignored"},
+    {IN_ISDIR, "directory"},
+    {IN_UNMOUNT, "unmount"},
+    {IN_Q_OVERFLOW, "overflow"},
+};
+
+// names for every value of every byte of a mask. Decoding joins at most
+// four precomputed strings instead of testing each flag.
+#define MAX_BYTE_NAMES 128
+
+static char byte_names[4][256][MAX_BYTE_NAMES];
+static uint8_t byte_lens[4][256];
+static uint32_t known_mask;
+
+static struct {
+  size_t len;
+  char buf[OUT_BUF_LEN];
+} out;
+
+void events_init(void) {
+  for (size_t i = 0; i < ARRAY_SIZE(inotify_event_flags); ++i) {
+    known_mask |= inotify_event_flags[i].mask;
+  }
+  for (int b = 0; b < 4; ++b) {
+    for (int v = 1; v < 256; ++v) {
+      size_t pos = 0;
+      for (size_t i = 0; i < ARRAY_SIZE(inotify_event_flags); ++i) {
+        uint32_t bit = inotify_event_flags[i].mask;
+        if (bit & ((uint32_t)v << (b * 8))) {
+          pos += snprintf(byte_names[b][v] + pos, MAX_BYTE_NAMES - pos, "|%s",
+                          inotify_event_flags[i].name);
+        }
+      }
+      byte_lens[b][v] = pos;
+    }
+  }
+}
+
+size_t event_mask_str(uint32_t mask, char *buf, size_t len) {
+  size_t pos = 0;
+  for (int b = 0; b < 4; ++b) {
+    uint8_t v = mask >> (b * 8);
+    size_t n = byte_lens[b][v];
+    if (n > 0 && pos + n < len) {
+      memcpy(buf + pos, byte_names[b][v], n);
+      pos += n;
+    }
+  }
+  // every piece starts with a separator, drop the first one
+  if (pos > 0) {
+    memmove(buf, buf + 1, pos - 1);
+    pos--;
+  }
+  if (len > 0) {
+    buf[pos] = '\0';
+  }
+  return pos;
+}
+
+bool is_valid_event(uint32_t mask) {
+  return (mask & known_mask) != 0;
+}
+
+void out_flush(void) {
+  size_t done = 0;
+  while (done < out.len) {
+    ssize_t n = write(STDOUT_FILENO, out.buf + done, out.len - done);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "write to stdout failed with errno %d\n", errno);
+      break;
+    }
+    done += n;
+  }
+  out.len = 0;
+}
+
+void out_printf(const char *fmt, ...) {
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(out.buf + out.len, sizeof(out.buf) - out.len, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+      return;
+    }
+    if (out.len + n < sizeof(out.buf)) {
+      out.len += n;
+      return;
+    }
+    // didn't fit, retry in an empty buffer. Longer lines are cut.
+    out_flush();
+  }
+  out.len = sizeof(out.buf) - 1;
+}
+
+void print_event(uint32_t mask, const char *dir, const char *name) {
+  char names[256];
+  event_mask_str(mask, names, sizeof(names));
+  if (name) {
+    out_printf("event %u (%s) %s/%s\n", mask, names, dir, name);
+  } else {
+    out_printf("event %u (%s) %s\n", mask, names, dir);
+  }
+}
+
+void print_record(const char *path, uint32_t mask, uint32_t count, void *arg) {
+  char names[256];
+  event_mask_str(mask, names, sizeof(names));
+  out_printf("%s %s (%u events)\n", path, names, count);
+}
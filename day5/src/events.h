@@ -0,0 +1,32 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// size of the buffer events are read into, room for a few thousand
+#define EVENT_BUF_LEN (64 * 1024)
+
+// builds the decoder tables, call once before anything else here
+void events_init(void);
+
+// writes the names of all known bits of mask to buf, separated by '|', and
+// returns the length. Takes the same time for any number of set bits.
+size_t event_mask_str(uint32_t mask, char *buf, size_t len);
+
+// true if mask has at least one bit we have a name for
+bool is_valid_event(uint32_t mask);
+
+// output is collected in a buffer and written to stdout in large chunks,
+// out_flush has to be called before the process blocks or exits
+void out_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void out_flush(void);
+
+// one raw event, name may be NULL for events on dir itself
+void print_event(uint32_t mask, const char *dir, const char *name);
+
+// one coalesced record, matches coalesce_emit_fn
+void print_record(const char *path, uint32_t mask, uint32_t count, void *arg);
+
+#endif
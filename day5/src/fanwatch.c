@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+#include "fanwatch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+
+// fanotify reuses the inotify values, so masks are passed through as is
+_Static_assert(FAN_ACCESS == IN_ACCESS && FAN_OPEN == IN_OPEN && FAN_CLOSE == IN_CLOSE
+              && FAN_CREATE == IN_CREATE && FAN_MOVE_SELF == IN_MOVE_SELF
+              && FAN_ONDIR == IN_ISDIR && FAN_Q_OVERFLOW == IN_Q_OVERFLOW,
+              "fanotify and inotify event bits differ");
+
+// events that fanotify can report in FID mode
+#define FANWATCH_EVENTS (FAN_ACCESS | FAN_MODIFY | FAN_ATTRIB | FAN_CLOSE | FAN_OPEN | FAN_MOVE \
+                         | FAN_CREATE | FAN_DELETE | FAN_DELETE_SELF | FAN_MOVE_SELF)
+
+int fanwatch_init(struct fanwatch *fw, uint32_t mask) {
+  memset(fw, 0, sizeof(*fw));
+  fw->mount_fd = -1;
+  fw->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_REPORT_DFID_NAME, O_RDONLY | O_LARGEFILE);
+  if (fw->fd == -1) {
+    fprintf(stderr, "fanotify_init failed with errno %d\n", errno);
+    return -1;
+  }
+  fw->mask = mask & FANWATCH_EVENTS;
+  fw->self = getpid();
+  fw->last = malloc(sizeof(struct file_handle) + MAX_HANDLE_SZ);
+  if (!fw->last) {
+    close(fw->fd);
+    return -1;
+  }
+  fw->last->handle_bytes = 0;
+  return 0;
+}
+
+void fanwatch_close(struct fanwatch *fw) {
+  if (close(fw->fd) == -1) {
+    fprintf(stderr, "close failed with errno %d\n", errno);
+  }
+  if (fw->mount_fd >= 0) {
+    close(fw->mount_fd);
+  }
+  free(fw->root);
+  free(fw->last);
+}
+
+int fanwatch_add(struct fanwatch *fw, const char *root) {
+  fw->mount_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fw->mount_fd == -1) {
+    fprintf(stderr, "failed to open %s with errno %d\n", root, errno);
+    return -1;
+  }
+  fw->root = strdup(root);
+  if (!fw->root) {
+    return -1;
+  }
+  fw->root_len = strlen(root);
+  // FAN_ONDIR, otherwise events on directories themselves are left out
+  if (fanotify_mark(fw->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, fw->mask | FAN_ONDIR,
+                    AT_FDCWD, root) == -1) {
+    fprintf(stderr, "fanotify_mark of %s failed with errno %d\n", root, errno);
+    return -1;
+  }
+  return 0;
+}
+
+size_t fanwatch_bytes(const struct fanwatch *fw) {
+  return sizeof(*fw) + sizeof(struct file_handle) + MAX_HANDLE_SZ + fw->root_len + 1;
+}
+
+// path of the directory fh refers to, NULL if it is gone already
+static const char *resolve(struct fanwatch *fw, struct file_handle *fh) {
+  if (fh->handle_bytes == fw->last->handle_bytes && fh->handle_type == fw->last->handle_type
+      && memcmp(fh->f_handle, fw->last->f_handle, fh->handle_bytes) == 0) {
+    return fw->last_path;
+  }
+  int fd = open_by_handle_at(fw->mount_fd, fh, O_PATH);
+  if (fd == -1) {
+    // ESTALE for directories deleted since the event
+    return NULL;
+  }
+  char link[32];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  ssize_t n = readlink(link, fw->last_path, sizeof(fw->last_path) - 1);
+  close(fd);
+  if (n == -1 || fh->handle_bytes > MAX_HANDLE_SZ) {
+    fw->last->handle_bytes = 0;
+    return NULL;
+  }
+  fw->last_path[n] = '\0';
+  memcpy(fw->last, fh, sizeof(*fh) + fh->handle_bytes);
+  return fw->last_path;
+}
+
+static bool below_root(const struct fanwatch *fw, const char *path) {
+  return strncmp(path, fw->root, fw->root_len) == 0
+         && (path[fw->root_len] == '/' || path[fw->root_len] == '\0' || fw->root_len == 1);
+}
+
+void fanwatch_decode(struct fanwatch *fw, const void *buf, size_t len, fanwatch_fn fn, void *arg) {
+  const struct fanotify_event_metadata *md = buf;
+  for (; FAN_EVENT_OK(md, len); md = FAN_EVENT_NEXT(md, len)) {
+    if (md->vers != FANOTIFY_METADATA_VERSION) {
+      fprintf(stderr, "unexpected fanotify metadata version %d\n", md->vers);
+      return;
+    }
+    if (md->mask & FAN_Q_OVERFLOW) {
+      // nothing to rebuild, the mark doesn't depend on the tree
+      fn(IN_Q_OVERFLOW, fw->root, NULL, arg);
+      continue;
+    }
+    // resolving handles touches /proc, don't report our own doings
+    if (md->pid == fw->self) {
+      continue;
+    }
+    const uint8_t *info = (const uint8_t *)md + md->metadata_len;
+    const uint8_t *end = (const uint8_t *)md + md->event_len;
+    while (info + sizeof(struct fanotify_event_info_header) <= end) {
+      const struct fanotify_event_info_fid *fid = (const void *)info;
+      if (fid->hdr.len == 0) {
+        break;
+      }
+      if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME
+          || fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID) {
+        struct file_handle *fh = (struct file_handle *)fid->handle;
+        const char *name = NULL;
+        if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+          name = (const char *)fh->f_handle + fh->handle_bytes;
+          if (strcmp(name, ".") == 0) {
+            name = NULL;
+          }
+        }
+        const char *dir = resolve(fw, fh);
+        if (dir && below_root(fw, dir)) {
+          fn(md->mask, dir, name, arg);
+        }
+        break;
+      }
+      info += fid->hdr.len;
+    }
+  }
+}
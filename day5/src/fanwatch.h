@@ -0,0 +1,43 @@
+#ifndef FANWATCH_H
+#define FANWATCH_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+
+// fanotify backend: a single FAN_MARK_FILESYSTEM mark covers every
+// directory of the file system root lives on, no matter how many there are
+// or how many get created later. Events carry the file handle of their
+// directory plus the entry name (FAN_REPORT_DFID_NAME), the handle is turned
+// back into a path with open_by_handle_at. Needs CAP_SYS_ADMIN, and
+// CAP_DAC_READ_SEARCH for resolving the handles.
+struct fanwatch {
+  int fd;
+  int mount_fd;         // any fd on the file system, for open_by_handle_at
+  uint32_t mask;        // events requested by the user, inotify bits
+  char *root;
+  size_t root_len;
+  pid_t self;
+  // the directory resolved last, events tend to come in bursts per directory
+  struct file_handle *last;
+  char last_path[PATH_MAX];
+};
+
+// called for every event below root, mask uses the inotify bits (the
+// fanotify ones have the same values) and name is NULL for events on dir
+typedef void (*fanwatch_fn)(uint32_t mask, const char *dir, const char *name, void *arg);
+
+int fanwatch_init(struct fanwatch *fw, uint32_t mask);
+void fanwatch_close(struct fanwatch *fw);
+
+// marks the file system of root, events outside of root are dropped
+int fanwatch_add(struct fanwatch *fw, const char *root);
+
+// hands every event in the len bytes read from fw->fd to fn
+void fanwatch_decode(struct fanwatch *fw, const void *buf, size_t len, fanwatch_fn fn, void *arg);
+
+// user space memory held by the backend
+size_t fanwatch_bytes(const struct fanwatch *fw);
+
+#endif
@@ -1,113 +1,281 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/inotify.h>
+#include <sys/stat.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/ioctl.h>
 
-#define ARRAY_SIZE(arr) (sizeof(arr)/sizeof(*(arr)))
+#include "coalesce.h"
+#include "events.h"
+#include "fanwatch.h"
+#include "watcher.h"
 
-struct event_flag {
-  int mask;
-  char *name;
-};
-
-struct event_flag inotify_event_flags[] = {
-    {IN_ACCESS, "access"},
-    {IN_ATTRIB, "attrib"},
-    {IN_CLOSE_WRITE, "close_write"},
-    {IN_CLOSE_NOWRITE, "close_nowrite"},
-    {IN_CREATE, "create"},
-    {IN_DELETE, "delete"},
-    {IN_DELETE_SELF, "delete_self"},
-    {IN_MODIFY, "modify"},
-    {IN_MOVE_SELF, "move_self"},
-    {IN_MOVED_FROM, "move_from"},
-    {IN_MOVED_TO, "moved_to"},
-    {IN_OPEN, "open"},
-    {IN_MOVE, "move"},
-    {IN_CLOSE, "close"},
-    {IN_MASK_ADD, "mask_add"},
-    {IN_IGNORED, "ignored"},
-    {IN_ISDIR, "directory"},
-    {IN_UNMOUNT, "unmount"},
-};
-
-static const char *get_event_str(int mask) {
-  size_t len = ARRAY_SIZE(inotify_event_flags);
-  for (size_t i = 0; i < len; ++i) {
-    if (inotify_event_flags[i].mask == mask) {
-      return inotify_event_flags[i].name;
+// creates ndirs directories below root, fanout per level, breadth first
+static int make_tree(const char *root, long ndirs, int fanout) {
+  if (mkdir(root, 0755) == -1 && errno != EEXIST) {
+    fprintf(stderr, "mkdir %s failed with errno %d\n", root, errno);
+    return -1;
+  }
+  char path[4096];
+  // directory i lives in the directory (i - 1) / fanout, 0 is root
+  for (long i = 1; i <= ndirs; ++i) {
+    char *p = path + sizeof(path);
+    *--p = '\0';
+    for (long j = i; j > 0; j = (j - 1) / fanout) {
+      char name[24];
+      int n = snprintf(name, sizeof(name), "/d%ld", (j - 1) % fanout);
+      p -= n;
+      memcpy(p, name, n);
+    }
+    size_t rlen = strlen(root);
+    p -= rlen;
+    memcpy(p, root, rlen);
+    if (mkdir(p, 0755) == -1 && errno != EEXIST) {
+      fprintf(stderr, "mkdir %s failed with errno %d\n", p, errno);
+      return -1;
     }
   }
-  return NULL;
+  return 0;
 }
 
-static const int is_valid_event(int mask) {
-  size_t len = ARRAY_SIZE(inotify_event_flags);
-  for (size_t i = 0; i < len; ++i) {
-    if (inotify_event_flags[i].mask == mask) {
-      return 1;
+// kernel slab memory in kB, the inotify marks are allocated from it
+static long slab_kb(void) {
+  FILE *f = fopen("/proc/meminfo", "r");
+  if (!f) {
+    return -1;
+  }
+  char line[128];
+  long kb = -1;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "Slab: %ld kB", &kb) == 1) {
+      break;
     }
   }
-  return 0;
+  fclose(f);
+  return kb;
 }
 
-static void print_event(const struct inotify_event *ev) {
-  const char *evn = get_event_str(ev->mask);
-  printf("event %d (%s) ", ev->mask, evn);
-  if (ev->len > 0) {
-    printf("%s\n", ev->name);
-  } else {
-    printf("\n");
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ms(void) {
+  return now_sec() * 1000;
+}
+
+// prints an event right away, or merges it into the coalescer passed as arg
+static void emit_event(uint32_t mask, const char *dir, const char *name, void *arg) {
+  struct coalescer *co = arg;
+  if (!co) {
+    print_event(mask, dir, name);
+    return;
+  }
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s%s%s", dir, name ? "/" : "", name ? name : "");
+  coalesce_add(co, path, mask, now_ms());
+}
+
+// rebuilds the watches after events were lost and reports the whole tree
+static int rescan(struct watcher *w, const char *root, void *emit_arg) {
+  out_flush();
+  fprintf(stderr, "event queue overflowed, rescanning %s\n", root);
+  if (watcher_rescan(w, root) == -1) {
+    return -1;
   }
+  emit_event(IN_Q_OVERFLOW, root, NULL, emit_arg);
+  return 0;
 }
 
-int main(void) {
-  void *buffer = malloc(4096);
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [-F] [-S] [-T NDIRS] [-w MS] [DIR]\n", prog);
+  fprintf(stderr, "  -F        use one fanotify mark on the file system instead of inotify watches\n");
+  fprintf(stderr, "  -S        set up the watches, print their cost and exit\n");
+  fprintf(stderr, "  -w MS     merge the events of a path over MS milliseconds into one line\n");
+  fprintf(stderr, "  -T NDIRS  first create a tree of NDIRS directories in DIR\n");
+}
+
+int main(int argc, char **argv) {
+  bool stats_only = false;
+  bool use_fanotify = false;
+  long tree_dirs = 0;
+  uint64_t window_ms = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "FST:w:")) != -1) {
+    switch (opt) {
+      case 'F':
+        use_fanotify = true;
+        break;
+      case 'S':
+        stats_only = true;
+        break;
+      case 'T':
+        tree_dirs = strtol(optarg, NULL, 10);
+        break;
+      case 'w':
+        window_ms = strtoull(optarg, NULL, 10);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  events_init();
+  // inotify_event holds ints, the records in the buffer have to be aligned
+  void *buffer = aligned_alloc(sysconf(_SC_PAGE_SIZE), EVENT_BUF_LEN);
   if (!buffer) {
-    fprintf(stderr, "malloc failed\n");
+    fprintf(stderr, "aligned_alloc failed\n");
     return 1;
   }
 
-  int inotfd = inotify_init();
-  if (inotfd == -1) {
-    fprintf(stderr, "inotify_init failed with errno %d\n", errno);
+  char *root = optind < argc ? realpath(argv[optind], NULL) : getcwd(NULL, 0);
+  if (tree_dirs > 0 && optind < argc && !root) {
+    // realpath fails until the tree root exists
+    root = strdup(argv[optind]);
+  }
+  if (!root) {
+    fprintf(stderr, "could not get directory name\n");
     return 1;
   }
+  if (tree_dirs > 0 && make_tree(root, tree_dirs, 10) == -1) {
+    return 1;
+  }
+
+  struct watcher w;
+  struct fanwatch fw;
+  int fd;
+  long slab_before = slab_kb();
+  double t0 = now_sec();
+  if (use_fanotify) {
+    if (fanwatch_init(&fw, IN_OPEN | IN_ACCESS | IN_CLOSE) == -1 || fanwatch_add(&fw, root) == -1) {
+      return 1;
+    }
+    double secs = now_sec() - t0;
+    long slab_after = slab_kb();
+    fprintf(stderr, "fanotify mark on the file system of %s, setup %.3f s\n", root, secs);
+    fprintf(stderr, "user memory %zu bytes, kernel slab +%ld kB\n", fanwatch_bytes(&fw),
+            slab_after - slab_before);
+    fd = fw.fd;
+  } else {
+    if (watcher_init(&w, IN_OPEN | IN_ACCESS | IN_CLOSE) == -1) {
+      return 1;
+    }
+    long nwatches = watcher_add_tree(&w, root);
+    double secs = now_sec() - t0;
+    if (nwatches == -1) {
+      return 1;
+    }
+    long slab_after = slab_kb();
+    fprintf(stderr, "watching %ld directories below %s, setup %.3f s (%.2f us per watch)\n",
+            nwatches, root, secs, secs * 1e6 / nwatches);
+    fprintf(stderr, "user memory %zu bytes (%.0f per watch), kernel slab +%ld kB (%.0f bytes per watch)\n",
+            wdmap_bytes(&w.map), (double)wdmap_bytes(&w.map) / nwatches, slab_after - slab_before,
+            (slab_after - slab_before) * 1024.0 / nwatches);
+    fd = w.fd;
+  }
+  if (stats_only) {
+    goto out;
+  }
 
-  char *cwd = getcwd(NULL, 0);
-  if (!cwd) {
-    fprintf(stderr, "could not get current directory name\n");
+  struct coalescer co;
+  if (window_ms > 0 && coalesce_init(&co, window_ms, now_ms()) == -1) {
     return 1;
   }
-  
-  inotify_add_watch(inotfd, cwd, IN_OPEN | IN_ACCESS | IN_CLOSE);
+  struct coalescer *emit_arg = window_ms > 0 ? &co : NULL;
+  // after a rescan the next one waits until the new queue was empty once,
+  // a tree that overflows under load would otherwise rescan back to back
+  bool draining = false;
+  bool rescan_due = false;
   while (true) {
-    ssize_t len = read(inotfd, buffer, 4096);
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int timeout = window_ms > 0 ? coalesce_timeout(&co, now_ms()) : -1;
+    // everything decoded so far goes out in one write before we may block
+    out_flush();
+    int ready = poll(&pfd, 1, timeout);
+    if (ready == -1 && errno != EINTR) {
+      fprintf(stderr, "poll failed with errno %d\n", errno);
+      return 1;
+    }
+    ssize_t len = ready > 0 ? read(fd, buffer, EVENT_BUF_LEN) : 0;
     if (len == -1 && errno != EAGAIN) {
       fprintf(stderr, "read error with errno %d\n", errno);
       return 1;
     }
-    if (len <= 0) {
+    if (ready > 0 && len == 0) {
       break;
     }
+    if (use_fanotify) {
+      if (len > 0) {
+        fanwatch_decode(&fw, buffer, len, emit_event, emit_arg);
+      }
+      len = 0;
+    }
     unsigned char *ptr = buffer;
-    while (ptr < (unsigned char*)buffer + len) {
+    while (len > 0 && ptr < (unsigned char*)buffer + len) {
       struct inotify_event *ev = (struct inotify_event *)ptr; 
-      if (is_valid_event(ev->mask)) {
-        print_event(ev);
+      if (ev->mask & IN_Q_OVERFLOW) {
+        // events were lost, including ones about new or removed
+        // directories: rebuild the watches and report the whole tree
+        if (draining) {
+          rescan_due = true;
+          ptr += sizeof(struct inotify_event) + ev->len;
+          continue;
+        }
+        if (rescan(&w, root, emit_arg) == -1) {
+          return 1;
+        }
+        fd = w.fd;
+        draining = true;
+        // the rest of the buffer refers to the old watches
+        break;
+      }
+      const char *dir = watcher_path(&w, ev->wd);
+      // tree tracking events are only printed if the user asked for them
+      if (dir && (ev->mask & w.mask) && is_valid_event(ev->mask) && !watcher_is_dup(&w, ev)) {
+        emit_event(ev->mask, dir, ev->len > 0 ? ev->name : NULL, emit_arg);
       }
+      watcher_update(&w, ev);
       ptr += sizeof(struct inotify_event) + ev->len; 
     }
+    int queued;
+    if (draining && ioctl(fd, FIONREAD, &queued) == 0 && queued == 0) {
+      draining = false;
+      if (rescan_due) {
+        rescan_due = false;
+        if (rescan(&w, root, emit_arg) == -1) {
+          return 1;
+        }
+        fd = w.fd;
+        draining = true;
+      }
+    }
+    if (window_ms > 0) {
+      coalesce_expire(&co, now_ms(), print_record, NULL);
+    }
   }
 
-  if (close(inotfd) == -1) {
-    fprintf(stderr, "close failed with errno %d\n", errno);
-    return 1;
+  if (window_ms > 0) {
+    coalesce_flush(&co, print_record, NULL);
+    coalesce_free(&co);
+  }
+  out_flush();
+out:
+  if (use_fanotify) {
+    fanwatch_close(&fw);
+  } else {
+    watcher_close(&w);
   }
-  free(cwd);
+  free(root);
   free(buffer);
   return 0;
 }
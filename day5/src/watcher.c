@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+#include "watcher.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+int watcher_init(struct watcher *w, uint32_t mask) {
+  w->fd = inotify_init1(IN_CLOEXEC);
+  if (w->fd == -1) {
+    fprintf(stderr, "inotify_init failed with errno %d\n", errno);
+    return -1;
+  }
+  w->mask = mask;
+  w->root_wd = -1;
+  if (wdmap_init(&w->map, 1024) == -1) {
+    close(w->fd);
+    return -1;
+  }
+  return 0;
+}
+
+void watcher_close(struct watcher *w) {
+  if (close(w->fd) == -1) {
+    fprintf(stderr, "close failed with errno %d\n", errno);
+  }
+  wdmap_free(&w->map);
+}
+
+static char *join_path(const char *dir, const char *name) {
+  size_t dlen = strlen(dir), nlen = strlen(name);
+  char *path = malloc(dlen + nlen + 2);
+  if (path) {
+    memcpy(path, dir, dlen);
+    path[dlen] = '/';
+    memcpy(path + dlen + 1, name, nlen + 1);
+  }
+  return path;
+}
+
+// stack of directories still to be walked
+struct dir_stack {
+  char **paths;
+  size_t len;
+  size_t cap;
+};
+
+static int push(struct dir_stack *st, char *path) {
+  if (st->len == st->cap) {
+    size_t cap = st->cap ? st->cap * 2 : 256;
+    char **paths = realloc(st->paths, cap * sizeof(*paths));
+    if (!paths) {
+      return -1;
+    }
+    st->paths = paths;
+    st->cap = cap;
+  }
+  st->paths[st->len++] = path;
+  return 0;
+}
+
+// adds the user's events to the watches of a finished walk
+static void watch_user_events(struct watcher *w, const int *wds, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    const char *path = wdmap_get(&w->map, wds[i]);
+    // a directory that is gone by now keeps tracking the tree only
+    if (path) {
+      inotify_add_watch(w->fd, path, w->mask | WATCHER_TREE_MASK | IN_MASK_ADD);
+    }
+  }
+}
+
+long watcher_add_tree(struct watcher *w, const char *root) {
+  struct dir_stack st = { 0 };
+  int *wds = NULL;
+  size_t wds_cap = 0;
+  char *first = strdup(root);
+  if (!first || push(&st, first) == -1) {
+    free(first);
+    return -1;
+  }
+  long added = 0;
+  int rc = 0;
+  while (st.len > 0) {
+    char *path = st.paths[--st.len];
+    // watch before listing, so a subdirectory created in between shows up
+    // either in the listing or as an event. Only the tree events for now,
+    // the walk itself opens and reads every directory, which must not be
+    // reported as user activity.
+    int wd = inotify_add_watch(w->fd, path, WATCHER_TREE_MASK);
+    if (wd == -1) {
+      if (errno == ENOSPC || errno == ENOMEM) {
+        fprintf(stderr, "out of inotify watches after %ld, raise fs.inotify.max_user_watches\n",
+                added);
+        free(path);
+        rc = -1;
+        break;
+      }
+      // vanished or not a directory anymore
+      free(path);
+      continue;
+    }
+    if (wdmap_put(&w->map, wd, path) == -1) {
+      free(path);
+      rc = -1;
+      break;
+    }
+    if ((size_t)added == wds_cap) {
+      wds_cap = wds_cap ? wds_cap * 2 : 256;
+      int *grown = realloc(wds, wds_cap * sizeof(*wds));
+      if (!grown) {
+        free(path);
+        rc = -1;
+        break;
+      }
+      wds = grown;
+    }
+    wds[added++] = wd;
+    if (w->root_wd == -1) {
+      w->root_wd = wd;
+    }
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+      free(path);
+      continue;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+      if (de->d_type == DT_UNKNOWN) {
+        struct stat sb;
+        if (fstatat(dirfd(dir), de->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(sb.st_mode)) {
+          de->d_type = DT_DIR;
+        }
+      }
+      if (de->d_type != DT_DIR || strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+        continue;
+      }
+      char *child = join_path(path, de->d_name);
+      if (!child || push(&st, child) == -1) {
+        free(child);
+        rc = -1;
+        break;
+      }
+    }
+    closedir(dir);
+    free(path);
+    if (rc == -1) {
+      break;
+    }
+  }
+  while (st.len > 0) {
+    free(st.paths[--st.len]);
+  }
+  free(st.paths);
+  watch_user_events(w, wds, added);
+  free(wds);
+  return rc == -1 ? -1 : added;
+}
+
+long watcher_rescan(struct watcher *w, const char *root) {
+  watcher_close(w);
+  if (watcher_init(w, w->mask) == -1) {
+    return -1;
+  }
+  return watcher_add_tree(w, root);
+}
+
+static void unwatch(int wd, void *arg) {
+  struct watcher *w = arg;
+  inotify_rm_watch(w->fd, wd);
+}
+
+void watcher_update(struct watcher *w, const struct inotify_event *ev) {
+  if (ev->mask & IN_IGNORED) {
+    // the directory was removed or unmounted
+    wdmap_del(&w->map, ev->wd);
+    return;
+  }
+  if (!(ev->mask & IN_ISDIR) || !(ev->mask & (IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO))
+      || ev->len == 0) {
+    return;
+  }
+  const char *dir = wdmap_get(&w->map, ev->wd);
+  if (!dir) {
+    return;
+  }
+  char *path = join_path(dir, ev->name);
+  if (path && (ev->mask & IN_MOVED_FROM)) {
+    // the old paths are wrong wherever the directory went. If it stayed in
+    // the tree, its IN_MOVED_TO walks it again under the new name.
+    wdmap_del_tree(&w->map, path, unwatch, w);
+  } else if (path) {
+    // opening the new directory would also show up as user events on the
+    // parent, so the parent tracks only the tree while it is walked
+    inotify_add_watch(w->fd, dir, WATCHER_TREE_MASK);
+    watcher_add_tree(w, path);
+    watch_user_events(w, &ev->wd, 1);
+  }
+  free(path);
+}
+
+bool watcher_is_dup(const struct watcher *w, const struct inotify_event *ev) {
+  // events about the watched directory itself only come on its own watch
+  uint32_t self = IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT | IN_IGNORED;
+  return ev->len == 0 && ev->wd != w->root_wd && !(ev->mask & self);
+}
+
+const char *watcher_path(const struct watcher *w, int wd) {
+  return wdmap_get(&w->map, wd);
+}
@@ -0,0 +1,47 @@
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/inotify.h>
+
+#include "wdmap.h"
+
+// events the watcher needs on every directory to follow the tree
+#define WATCHER_TREE_MASK (IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+// recursive inotify watcher, one watch per directory. The wd -> path map
+// turns the wd of an event back into the directory it happened in.
+struct watcher {
+  int fd;
+  uint32_t mask;      // events requested by the user
+  int root_wd;        // first watch added, the only one without a parent
+  struct wd_map map;
+};
+
+int watcher_init(struct watcher *w, uint32_t mask);
+void watcher_close(struct watcher *w);
+
+// watches root and every directory below it. Returns the number of watches
+// added, or -1 if inotify ran out of watches or memory.
+long watcher_add_tree(struct watcher *w, const char *root);
+
+// drops every watch and walks root again from scratch, after the kernel
+// dropped events (IN_Q_OVERFLOW) the map can't be trusted anymore. The
+// watcher gets a new inotify fd.
+long watcher_rescan(struct watcher *w, const char *root);
+
+// keeps the watches in sync with the tree: watches directories created or
+// moved into it, drops the watches of directories moved away and forgets
+// the ones the kernel dropped. Call for every event before using its wd.
+void watcher_update(struct watcher *w, const struct inotify_event *ev);
+
+// a subdirectory reports its events twice, on its own watch without a name
+// and on its parent's with one. True for the nameless copy, which should be
+// skipped; only the root, whose parent isn't watched, keeps it.
+bool watcher_is_dup(const struct watcher *w, const struct inotify_event *ev);
+
+// directory the event's wd refers to, NULL for unknown wds
+const char *watcher_path(const struct watcher *w, int wd);
+
+#endif
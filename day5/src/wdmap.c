@@ -0,0 +1,145 @@
+#include "wdmap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define WD_EMPTY 0
+#define WD_TOMB -1
+
+static size_t wd_hash(int wd, size_t cap) {
+  // Fibonacci hashing, consecutive wds land far apart
+  return ((uint32_t)wd * 2654435769u) & (cap - 1);
+}
+
+int wdmap_init(struct wd_map *map, size_t cap) {
+  size_t pow2 = 16;
+  while (pow2 < cap) {
+    pow2 <<= 1;
+  }
+  map->slots = calloc(pow2, sizeof(*map->slots));
+  if (!map->slots) {
+    fprintf(stderr, "failed to allocate watch map\n");
+    return -1;
+  }
+  map->cap = pow2;
+  map->count = 0;
+  map->used = 0;
+  map->path_bytes = 0;
+  return 0;
+}
+
+void wdmap_free(struct wd_map *map) {
+  for (size_t i = 0; i < map->cap; ++i) {
+    if (map->slots[i].wd > 0) {
+      free(map->slots[i].path);
+    }
+  }
+  free(map->slots);
+  map->slots = NULL;
+}
+
+static struct wd_entry *find(const struct wd_map *map, int wd) {
+  for (size_t i = wd_hash(wd, map->cap);; i = (i + 1) & (map->cap - 1)) {
+    if (map->slots[i].wd == wd) {
+      return &map->slots[i];
+    }
+    if (map->slots[i].wd == WD_EMPTY) {
+      return NULL;
+    }
+  }
+}
+
+// doubles the table, or rehashes in place if mostly deleted slots filled it
+static int grow(struct wd_map *map) {
+  size_t cap = map->count * 2 >= map->cap / 2 ? map->cap * 2 : map->cap;
+  struct wd_entry *slots = calloc(cap, sizeof(*slots));
+  if (!slots) {
+    fprintf(stderr, "failed to grow watch map\n");
+    return -1;
+  }
+  for (size_t i = 0; i < map->cap; ++i) {
+    int wd = map->slots[i].wd;
+    if (wd > 0) {
+      size_t j = wd_hash(wd, cap);
+      while (slots[j].wd != WD_EMPTY) {
+        j = (j + 1) & (cap - 1);
+      }
+      slots[j] = map->slots[i];
+    }
+  }
+  free(map->slots);
+  map->slots = slots;
+  map->cap = cap;
+  map->used = map->count;
+  return 0;
+}
+
+int wdmap_put(struct wd_map *map, int wd, const char *path) {
+  char *copy = strdup(path);
+  if (!copy) {
+    return -1;
+  }
+  struct wd_entry *e = find(map, wd);
+  if (e) {
+    map->path_bytes -= strlen(e->path) + 1;
+    free(e->path);
+    e->path = copy;
+    map->path_bytes += strlen(copy) + 1;
+    return 0;
+  }
+  if ((map->used + 1) * 10 > map->cap * 7 && grow(map) == -1) {
+    free(copy);
+    return -1;
+  }
+  size_t i = wd_hash(wd, map->cap);
+  while (map->slots[i].wd > 0) {
+    i = (i + 1) & (map->cap - 1);
+  }
+  if (map->slots[i].wd == WD_EMPTY) {
+    map->used++;
+  }
+  map->slots[i] = (struct wd_entry){ wd, copy };
+  map->count++;
+  map->path_bytes += strlen(copy) + 1;
+  return 0;
+}
+
+const char *wdmap_get(const struct wd_map *map, int wd) {
+  struct wd_entry *e = find(map, wd);
+  return e ? e->path : NULL;
+}
+
+void wdmap_del(struct wd_map *map, int wd) {
+  struct wd_entry *e = find(map, wd);
+  if (!e) {
+    return;
+  }
+  map->path_bytes -= strlen(e->path) + 1;
+  free(e->path);
+  e->path = NULL;
+  e->wd = WD_TOMB;
+  map->count--;
+}
+
+void wdmap_del_tree(struct wd_map *map, const char *dir, void (*fn)(int wd, void *arg), void *arg) {
+  size_t dlen = strlen(dir);
+  for (size_t i = 0; i < map->cap; ++i) {
+    struct wd_entry *e = &map->slots[i];
+    if (e->wd <= 0 || strncmp(e->path, dir, dlen) != 0
+        || (e->path[dlen] != '\0' && e->path[dlen] != '/')) {
+      continue;
+    }
+    fn(e->wd, arg);
+    map->path_bytes -= strlen(e->path) + 1;
+    free(e->path);
+    e->path = NULL;
+    e->wd = WD_TOMB;
+    map->count--;
+  }
+}
+
+size_t wdmap_bytes(const struct wd_map *map) {
+  return map->cap * sizeof(*map->slots) + map->path_bytes;
+}
@@ -0,0 +1,35 @@
+#ifndef WDMAP_H
+#define WDMAP_H
+
+#include <stddef.h>
+
+// open-addressing hash map from inotify watch descriptor to the path of the
+// watched directory. wds are >= 1, so 0 marks empty and -1 deleted slots.
+struct wd_entry {
+  int wd;
+  char *path;
+};
+
+struct wd_map {
+  struct wd_entry *slots;
+  size_t cap;         // power of two
+  size_t count;       // live entries
+  size_t used;        // live and deleted slots
+  size_t path_bytes;  // bytes held by path copies
+};
+
+int wdmap_init(struct wd_map *map, size_t cap);
+void wdmap_free(struct wd_map *map);
+
+// stores a copy of path for wd, replacing an older one
+int wdmap_put(struct wd_map *map, int wd, const char *path);
+const char *wdmap_get(const struct wd_map *map, int wd);
+void wdmap_del(struct wd_map *map, int wd);
+
+// removes dir and every path below it, calling fn with each wd on the way
+void wdmap_del_tree(struct wd_map *map, const char *dir, void (*fn)(int wd, void *arg), void *arg);
+
+// heap memory used by the map, slots and paths
+size_t wdmap_bytes(const struct wd_map *map);
+
+#endif
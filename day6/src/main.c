@@ -11,27 +11,18 @@
 #include <stdlib.h>
 #include <sys/ucontext.h>
 #include <errno.h>
+#include <time.h>
+
+#include "sparse.h"
+#include "uffd.h"
 
 int PAGE_SIZE;
 
 volatile bool do_exit = false;
 
-static void sigsegv_action(int signo, siginfo_t *info, void *ctx) {
-  printf("SIGSEGV handler called at addr %p\n", info->si_addr);
-  void *addr = info->si_addr;
-  void *maddr = mmap(addr, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (maddr == MAP_FAILED) {
-    printf("mmap failed with errno %d\n", errno);
-  }
-  printf("mmap'd new page for %p starting at %p\n", addr, maddr);
-}
-
-static void install_sigsegv_handler(void) {
-  struct sigaction action;
-  action.sa_sigaction = sigsegv_action;
-  action.sa_flags = SA_SIGINFO;
-  sigaction(SIGSEGV, &action, NULL);
-}
+// address space the demo writes into, its pages are filled in on first
+// touch by the userfaultfd handler thread
+#define DEMO_REGION (1ul << 30)
 
 static void sigill_action(int signo, siginfo_t *info, void *ctx) {
   ucontext_t *uctx =(ucontext_t *)ctx;
@@ -67,26 +58,267 @@ static void dump_pmap(void) {
   system(cmd);
 }
 
-int main(void) {
+// gen page source: every word holds its own offset in the region, the
+// file source reads a file with the same contents
+static void gen_page(void *page, size_t off, void *arg) {
+  uint64_t *words = page;
+  for (size_t i = 0; i < PAGE_SIZE / sizeof(*words); ++i) {
+    words[i] = off + i * sizeof(*words);
+  }
+}
+
+// state of the signal path, the handler can't be passed arguments
+static struct page_source sig_src;
+static uint8_t *sig_base;
+
+// the signal path of the fault benchmark: opens up the faulting page and
+// fills it in place. Only async-signal-safe calls, unlike sigsegv_action.
+static void fault_sigsegv(int signo, siginfo_t *info, void *ctx) {
+  uint8_t *page = (uint8_t *)((uintptr_t)info->si_addr & ~(uintptr_t)(PAGE_SIZE - 1));
+  if (mprotect(page, PAGE_SIZE, PROT_READ | PROT_WRITE) == -1) {
+    abort();
+  }
+  if (sig_src.kind != PAGE_SOURCE_ZERO) {
+    page_source_fill(&sig_src, page, page - sig_base);
+  }
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// touches every page once, lat[i] is the time the first access of page i
+// took. Returns -1 if a page doesn't have the contents of its source.
+static int touch_pages(uint8_t *base, size_t npages, bool write, enum page_source_kind kind,
+                       uint64_t *lat) {
+  for (size_t i = 0; i < npages; ++i) {
+    volatile uint64_t *word = (volatile uint64_t *)(base + i * PAGE_SIZE);
+    uint64_t start = now_ns();
+    if (write) {
+      word[1] = 1;
+    } else {
+      (void)word[1];
+    }
+    lat[i] = now_ns() - start;
+  }
+  for (size_t i = 0; i < npages; ++i) {
+    uint64_t expect = kind == PAGE_SOURCE_ZERO ? 0 : i * PAGE_SIZE;
+    if (*(uint64_t *)(base + i * PAGE_SIZE) != expect) {
+      fprintf(stderr, "page %zu holds %lu instead of %lu\n", i, *(uint64_t *)(base + i * PAGE_SIZE), expect);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void print_latency(const char *path, uint64_t *lat, size_t n) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    sum += lat[i];
+  }
+  qsort(lat, n, sizeof(*lat), cmp_u64);
+  printf("%-8s faults %zu mean %.2f us p50 %.2f us p99 %.2f us max %.2f us\n", path, n,
+         sum / 1e3 / n, lat[n / 2] / 1e3, lat[n * 99 / 100] / 1e3, lat[n - 1] / 1e3);
+}
+
+// compares first-touch latency of npages pages populated by a userfaultfd
+// handler thread with the same pages populated by a SIGSEGV handler
+static int fault_bench(size_t npages, const char *source, bool write) {
+  struct page_source src = { .kind = PAGE_SOURCE_ZERO, .fd = -1 };
+  if (strcmp(source, "gen") == 0) {
+    src.kind = PAGE_SOURCE_GEN;
+    src.gen = gen_page;
+  } else if (strcmp(source, "file") == 0) {
+    src.kind = PAGE_SOURCE_FILE;
+    FILE *f = tmpfile();
+    if (!f) {
+      fprintf(stderr, "tmpfile failed with errno %d\n", errno);
+      return 1;
+    }
+    src.fd = fileno(f);
+    uint8_t *page = malloc(PAGE_SIZE);
+    for (size_t i = 0; page && i < npages; ++i) {
+      gen_page(page, i * PAGE_SIZE, NULL);
+      if (pwrite(src.fd, page, PAGE_SIZE, i * PAGE_SIZE) != PAGE_SIZE) {
+        fprintf(stderr, "writing the page file failed with errno %d\n", errno);
+        return 1;
+      }
+    }
+    free(page);
+  } else if (strcmp(source, "zero") != 0) {
+    fprintf(stderr, "unknown page source %s, use zero, file or gen\n", source);
+    return 1;
+  }
+  uint64_t *lat = calloc(npages, sizeof(*lat));
+  if (!lat) {
+    fprintf(stderr, "calloc failed\n");
+    return 1;
+  }
+  printf("%zu pages, source %s, %s faults\n", npages, source, write ? "write" : "read");
+
+  struct uffd_region r;
+  if (uffd_region_init(&r, npages * PAGE_SIZE, &src) == -1) {
+    return 1;
+  }
+  if (touch_pages(r.base, npages, write, src.kind, lat) == -1) {
+    return 1;
+  }
+  struct uffd_stats stats;
+  uffd_region_stats(&r, &stats);
+  uffd_region_free(&r);
+  print_latency("uffd", lat, npages);
+  printf("         handler %.2f us per fault, %lu zero pages, %lu copies\n",
+         stats.handler_ns / 1e3 / stats.faults, stats.zero_pages, stats.copies);
+
+  sig_src = src;
+  sig_base = mmap(NULL, npages * PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (sig_base == MAP_FAILED) {
+    fprintf(stderr, "mmap failed with errno %d\n", errno);
+    return 1;
+  }
+  struct sigaction action = { .sa_sigaction = fault_sigsegv, .sa_flags = SA_SIGINFO };
+  struct sigaction old;
+  sigaction(SIGSEGV, &action, &old);
+  int rc = touch_pages(sig_base, npages, write, src.kind, lat);
+  sigaction(SIGSEGV, &old, NULL);
+  munmap(sig_base, npages * PAGE_SIZE);
+  if (rc == -1) {
+    return 1;
+  }
+  print_latency("sigsegv", lat, npages);
+  free(lat);
+  return 0;
+}
+
+// resident set size in pages
+static long rss_pages(void) {
+  long size, rss = -1;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%ld %ld", &size, &rss) != 2) {
+      rss = -1;
+    }
+    fclose(f);
+  }
+  return rss;
+}
+
+// scatters ntouch writes over a sparse region of gb GiB and shows that
+// memory use follows the touched pages, before and after releasing them
+static int sparse_demo(size_t gb, size_t ntouch, size_t pool_pages) {
+  struct sparse_region r;
+  size_t len = gb << 30;
+  long rss_before = rss_pages();
+  if (sparse_init(&r, len, pool_pages) == -1) {
+    return 1;
+  }
+  size_t npages = len / PAGE_SIZE;
+  printf("reserved %zu GiB (%zu pages), pool of %zu pages, %s\n", gb, npages, pool_pages,
+         r.move ? "pages moved with UFFDIO_MOVE" : "no UFFDIO_MOVE, pages copied");
+
+  // the same pseudo random page sequence for writing and checking
+  uint64_t seed = 1;
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < ntouch; ++i) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    size_t page = (seed >> 16) % npages;
+    *(uint64_t *)(r.base + page * PAGE_SIZE) = page + 1;
+  }
+  uint64_t ns = now_ns() - start;
+  seed = 1;
+  for (size_t i = 0; i < ntouch; ++i) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    size_t page = (seed >> 16) % npages;
+    if (*(uint64_t *)(r.base + page * PAGE_SIZE) != page + 1) {
+      fprintf(stderr, "page %zu lost its contents\n", page);
+      return 1;
+    }
+  }
+  struct sparse_stats stats;
+  sparse_stats(&r, &stats);
+  printf("touched %zu times: %lu pages materialized (%.2f us each), %lu pool refills\n",
+         ntouch, stats.faults, ns / 1e3 / (stats.faults ? stats.faults : 1), stats.refills);
+  printf("resident %lu pages, rss +%ld pages for %zu logical pages\n", stats.resident,
+         rss_pages() - rss_before, npages);
+
+  // lookups of missing entries: reads of untouched pages must not use memory
+  seed = 2;
+  uint64_t found = 0;
+  for (size_t i = 0; i < ntouch; ++i) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    found += *(volatile uint64_t *)(r.base + ((seed >> 16) % npages) * PAGE_SIZE) != 0;
+  }
+  sparse_stats(&r, &stats);
+  printf("looked up %zu pages (%lu present): %lu zero pages mapped, rss +%ld pages\n", ntouch,
+         found, stats.zero_pages, rss_pages() - rss_before);
+
+  long released = sparse_release(&r, r.base, len);
+  if (released == -1) {
+    return 1;
+  }
+  sparse_stats(&r, &stats);
+  printf("released %ld pages, resident %lu pages, rss +%ld pages\n", released, stats.resident,
+         rss_pages() - rss_before);
+  if (*(volatile uint64_t *)(r.base + (npages - 1) * PAGE_SIZE) != 0) {
+    fprintf(stderr, "released page is not zero\n");
+    return 1;
+  }
+  sparse_free(&r);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  PAGE_SIZE = sysconf(_SC_PAGE_SIZE);
+  if (argc > 1 && strcmp(argv[1], "fault") == 0) {
+    size_t npages = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000;
+    const char *source = argc > 3 ? argv[3] : "zero";
+    bool write = argc > 4 && argv[4][0] == 'w';
+    return fault_bench(npages > 0 ? npages : 1, source, write);
+  }
+  if (argc > 1 && strcmp(argv[1], "sparse") == 0) {
+    size_t gb = argc > 2 ? strtoul(argv[2], NULL, 10) : 64;
+    size_t ntouch = argc > 3 ? strtoul(argv[3], NULL, 10) : 10000;
+    size_t pool = argc > 4 ? strtoul(argv[4], NULL, 10) : 512;
+    return sparse_demo(gb > 0 ? gb : 1, ntouch, pool);
+  }
+
 #define INVALID_OPCODE_32_BIT() __asm__("ud2; ud2;")
-  install_sigsegv_handler();
   install_sigill_handler();
   install_sigint_handler();
 
-  PAGE_SIZE = sysconf(_SC_PAGE_SIZE);
-  uint32_t *addr = (uint32_t *)0xdeadbeef;
+  struct uffd_region demo;
+  struct page_source zero = { .kind = PAGE_SOURCE_ZERO, .fd = -1 };
+  if (uffd_region_init(&demo, DEMO_REGION, &zero) == -1) {
+    return EXIT_FAILURE;
+  }
+  struct uffd_stats stats;
+  uint32_t *addr = (uint32_t *)(demo.base + 0xdeadbeef % DEMO_REGION);
   *addr = 23;
-
+  uffd_region_stats(&demo, &stats);
+  printf("wrote %p, %lu faults resolved\n", (void *)addr, stats.faults);
 
   INVALID_OPCODE_32_BIT();
 
   while (!do_exit) {
     sleep(1);
     addr += 22559;
+    if ((uint8_t *)(addr + 1) > demo.base + DEMO_REGION) {
+      addr -= DEMO_REGION / sizeof(*addr);
+    }
     *addr = 42;
+    uffd_region_stats(&demo, &stats);
+    printf("wrote %p, %lu faults resolved\n", (void *)addr, stats.faults);
     INVALID_OPCODE_32_BIT();
   }
 
   dump_pmap();
+  uffd_region_free(&demo);
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+#include "sparse.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <linux/userfaultfd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// linux 6.8, missing from older uapi headers
+#ifndef UFFDIO_MOVE
+#define UFFD_FEATURE_MOVE (1 << 16)
+#define _UFFDIO_MOVE 0x05
+struct uffdio_move {
+  uint64_t dst;
+  uint64_t src;
+  uint64_t len;
+  uint64_t mode;
+  int64_t move;
+};
+#define UFFDIO_MOVE _IOWR(UFFDIO, _UFFDIO_MOVE, struct uffdio_move)
+#endif
+
+#define SPARSE_MSG_BATCH 16
+
+// pages counted by mincore at once in sparse_release
+#define MINCORE_CHUNK 4096
+
+static size_t page_size(void) {
+  return sysconf(_SC_PAGE_SIZE);
+}
+
+// a fault the handler can't resolve blocks the faulting thread in the
+// kernel forever, fail loudly instead of hanging
+static void handler_fatal(const char *what) {
+  fprintf(stderr, "%s failed with errno %d, the faulting thread can't be resumed\n", what, errno);
+  abort();
+}
+
+// features can only be negotiated once per uffd, ask a throwaway one first
+static uint64_t uffd_features(void) {
+  int fd = syscall(SYS_userfaultfd, O_CLOEXEC);
+  if (fd == -1) {
+    return 0;
+  }
+  struct uffdio_api api = { .api = UFFD_API, .features = 0 };
+  uint64_t features = ioctl(fd, UFFDIO_API, &api) == 0 ? api.features : 0;
+  close(fd);
+  return features;
+}
+
+// populates the whole pool again, pages moved out left holes in it
+static int pool_refill(struct sparse_region *r) {
+  if (madvise(r->pool, r->pool_pages * page_size(), MADV_POPULATE_WRITE) == -1) {
+    fprintf(stderr, "populating the page pool failed with errno %d\n", errno);
+    return -1;
+  }
+  r->pool_next = 0;
+  atomic_fetch_add_explicit(&r->refills, 1, memory_order_relaxed);
+  return 0;
+}
+
+// reads of untouched pages map the shared zero page, so looking up missing
+// entries costs no memory. Only writes take a page from the pool.
+static void materialize(struct sparse_region *r, uintptr_t addr, bool write) {
+  if (write && r->pool_next == r->pool_pages && pool_refill(r) == -1) {
+    handler_fatal("pool refill");
+  }
+  uint8_t *page = r->pool + r->pool_next * page_size();
+  // counted before the ioctl wakes the faulting thread, so the stats never
+  // lag behind what the application saw
+  atomic_fetch_add_explicit(write ? &r->faults : &r->zero_pages, 1, memory_order_relaxed);
+  int rc;
+  do {
+    if (!write) {
+      struct uffdio_zeropage zp = { .range = { .start = addr, .len = page_size() } };
+      rc = ioctl(r->uffd, UFFDIO_ZEROPAGE, &zp);
+    } else if (r->move) {
+      struct uffdio_move move = { .dst = addr, .src = (uintptr_t)page, .len = page_size(), .mode = 0 };
+      rc = ioctl(r->uffd, UFFDIO_MOVE, &move);
+    } else {
+      struct uffdio_copy copy = { .dst = addr, .src = (uintptr_t)page, .len = page_size(), .mode = 0 };
+      rc = ioctl(r->uffd, UFFDIO_COPY, &copy);
+    }
+    // EAGAIN: the mappings changed meanwhile, the page is still missing
+  } while (rc == -1 && errno == EAGAIN);
+  if (rc == -1) {
+    if (errno != EEXIST) {
+      handler_fatal("materializing a page");
+    }
+    // another fault on the same page won
+    atomic_fetch_sub_explicit(write ? &r->faults : &r->zero_pages, 1, memory_order_relaxed);
+    return;
+  }
+  // a copied pool page stays zero and can be handed out again
+  if (write) {
+    r->pool_next += r->move;
+  }
+}
+
+static void *handler_thread(void *arg) {
+  struct sparse_region *r = arg;
+  struct uffd_msg msgs[SPARSE_MSG_BATCH];
+  while (true) {
+    struct pollfd pfd[2] = {
+      { .fd = r->uffd, .events = POLLIN },
+      { .fd = r->stop_fd, .events = POLLIN },
+    };
+    if (poll(pfd, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      handler_fatal("poll on userfaultfd");
+    }
+    if (pfd[1].revents & POLLIN) {
+      return NULL;
+    }
+    ssize_t n = read(r->uffd, msgs, sizeof(msgs));
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EINTR) {
+        continue;
+      }
+      handler_fatal("read from userfaultfd");
+    }
+    for (size_t i = 0; i < n / sizeof(*msgs); ++i) {
+      if (msgs[i].event == UFFD_EVENT_PAGEFAULT) {
+        materialize(r, msgs[i].arg.pagefault.address & ~(uintptr_t)(page_size() - 1),
+                    msgs[i].arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WRITE);
+      }
+    }
+  }
+}
+
+int sparse_init(struct sparse_region *r, size_t len, size_t pool_pages) {
+  memset(r, 0, sizeof(*r));
+  r->len = (len + page_size() - 1) & ~(page_size() - 1);
+  r->pool_pages = pool_pages > 0 ? pool_pages : 1;
+  r->base = MAP_FAILED;
+  r->pool = MAP_FAILED;
+  r->stop_fd = -1;
+  r->move = uffd_features() & UFFD_FEATURE_MOVE;
+  r->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  if (r->uffd == -1) {
+    fprintf(stderr, "userfaultfd failed with errno %d\n", errno);
+    return -1;
+  }
+  struct uffdio_api api = { .api = UFFD_API, .features = r->move ? UFFD_FEATURE_MOVE : 0 };
+  if (ioctl(r->uffd, UFFDIO_API, &api) == -1) {
+    fprintf(stderr, "UFFDIO_API failed with errno %d\n", errno);
+    goto fail;
+  }
+  // MAP_NORESERVE: nothing is committed for the range, memory is only used
+  // by the pages that get materialized
+  r->base = mmap(NULL, r->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  r->pool = mmap(NULL, r->pool_pages * page_size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (r->base == MAP_FAILED || r->pool == MAP_FAILED) {
+    fprintf(stderr, "reserving %zu bytes failed with errno %d\n", r->len, errno);
+    goto fail;
+  }
+  // UFFDIO_MOVE works on small pages, a huge pool page would be split on
+  // every move
+  madvise(r->pool, r->pool_pages * page_size(), MADV_NOHUGEPAGE);
+  madvise(r->base, r->len, MADV_NOHUGEPAGE);
+  struct uffdio_register reg = {
+    .range = { .start = (uintptr_t)r->base, .len = r->len },
+    .mode = UFFDIO_REGISTER_MODE_MISSING,
+  };
+  if (ioctl(r->uffd, UFFDIO_REGISTER, &reg) == -1) {
+    fprintf(stderr, "UFFDIO_REGISTER failed with errno %d\n", errno);
+    goto fail;
+  }
+  if (pool_refill(r) == -1) {
+    goto fail;
+  }
+  atomic_store(&r->refills, 0);
+  r->stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (r->stop_fd == -1) {
+    fprintf(stderr, "eventfd failed with errno %d\n", errno);
+    goto fail;
+  }
+  int err = pthread_create(&r->thread, NULL, handler_thread, r);
+  if (err != 0) {
+    fprintf(stderr, "pthread_create failed with errno %d\n", err);
+    goto fail;
+  }
+  return 0;
+
+fail:
+  if (r->base != MAP_FAILED) {
+    munmap(r->base, r->len);
+  }
+  if (r->pool != MAP_FAILED) {
+    munmap(r->pool, r->pool_pages * page_size());
+  }
+  if (r->stop_fd >= 0) {
+    close(r->stop_fd);
+  }
+  close(r->uffd);
+  return -1;
+}
+
+void sparse_free(struct sparse_region *r) {
+  uint64_t one = 1;
+  if (write(r->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+    fprintf(stderr, "failed to stop the fault handler, errno %d\n", errno);
+  } else {
+    pthread_join(r->thread, NULL);
+  }
+  munmap(r->base, r->len);
+  munmap(r->pool, r->pool_pages * page_size());
+  close(r->stop_fd);
+  close(r->uffd);
+}
+
+long sparse_release(struct sparse_region *r, void *addr, size_t len) {
+  uint8_t *start = addr;
+  len = (len + page_size() - 1) & ~(page_size() - 1);
+  if (start < r->base || start + len > r->base + r->len) {
+    fprintf(stderr, "sparse_release: %p is outside of the region\n", addr);
+    return -1;
+  }
+  // count what is resident first, the range may be mostly holes
+  long resident = 0;
+  unsigned char vec[MINCORE_CHUNK];
+  for (size_t off = 0; off < len; off += MINCORE_CHUNK * page_size()) {
+    size_t chunk = len - off < MINCORE_CHUNK * page_size() ? len - off : MINCORE_CHUNK * page_size();
+    if (mincore(start + off, chunk, vec) == -1) {
+      fprintf(stderr, "mincore failed with errno %d\n", errno);
+      return -1;
+    }
+    for (size_t i = 0; i < chunk / page_size(); ++i) {
+      resident += vec[i] & 1;
+    }
+  }
+  // the next touch of a dropped page is a missing fault again
+  if (madvise(start, len, MADV_DONTNEED) == -1) {
+    fprintf(stderr, "madvise(MADV_DONTNEED) failed with errno %d\n", errno);
+    return -1;
+  }
+  atomic_fetch_add_explicit(&r->released, resident, memory_order_relaxed);
+  return resident;
+}
+
+void sparse_stats(struct sparse_region *r, struct sparse_stats *stats) {
+  stats->faults = atomic_load(&r->faults);
+  stats->zero_pages = atomic_load(&r->zero_pages);
+  stats->refills = atomic_load(&r->refills);
+  stats->released = atomic_load(&r->released);
+  stats->resident = stats->faults + stats->zero_pages - stats->released;
+}
@@ -0,0 +1,54 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// large zero-initialized region whose memory use follows the pages that are
+// actually used. Nothing is committed when the range is reserved, the first
+// write to a page faults into a handler thread (userfaultfd), which moves a
+// page from a pool of already populated pages into place with UFFDIO_MOVE.
+// A first read maps the shared zero page, a later write to it is copied by
+// the kernel as usual.
+// The pool is refilled in one go when it runs dry, so a fault costs no
+// mmap, no page allocation and no new mapping. Pages released with
+// sparse_release are given back to the kernel and read as zero again.
+struct sparse_region {
+  uint8_t *base;
+  size_t len;
+  uint8_t *pool;
+  size_t pool_pages;
+  size_t pool_next;           // first pool page not handed out yet
+  bool move;                  // kernel has UFFDIO_MOVE, else pages are copied
+  int uffd;
+  int stop_fd;
+  pthread_t thread;
+  _Atomic uint64_t faults;
+  _Atomic uint64_t zero_pages;
+  _Atomic uint64_t refills;
+  _Atomic uint64_t released;
+};
+
+struct sparse_stats {
+  uint64_t faults;          // pages materialized from the pool
+  uint64_t zero_pages;      // pages read first, mapped to the zero page
+  uint64_t refills;         // times the pool was populated again
+  uint64_t released;        // resident pages given back
+  uint64_t resident;        // pages currently mapped, zero page included
+};
+
+// reserves len bytes (any size the address space allows) with a pool of
+// pool_pages pages
+int sparse_init(struct sparse_region *r, size_t len, size_t pool_pages);
+void sparse_free(struct sparse_region *r);
+
+// drops the pages in [addr, addr + len) with MADV_DONTNEED, addr must be
+// page aligned. Returns the number of pages that were resident or -1.
+long sparse_release(struct sparse_region *r, void *addr, size_t len);
+
+void sparse_stats(struct sparse_region *r, struct sparse_stats *stats);
+
+#endif
@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+#include "uffd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/userfaultfd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// messages read from the uffd at once
+#define UFFD_MSG_BATCH 16
+
+static size_t page_size(void) {
+  return sysconf(_SC_PAGE_SIZE);
+}
+
+// a fault the handler can't resolve blocks the faulting thread in the
+// kernel forever, fail loudly instead of hanging
+static void handler_fatal(const char *what) {
+  fprintf(stderr, "%s failed with errno %d, the faulting thread can't be resumed\n", what, errno);
+  abort();
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void page_source_fill(const struct page_source *src, void *page, size_t off) {
+  size_t len = page_size();
+  switch (src->kind) {
+    case PAGE_SOURCE_ZERO:
+      memset(page, 0, len);
+      break;
+    case PAGE_SOURCE_FILE: {
+      size_t done = 0;
+      while (done < len) {
+        ssize_t n = pread(src->fd, (uint8_t *)page + done, len - done, src->file_off + off + done);
+        if (n == -1 && errno == EINTR) {
+          continue;
+        }
+        if (n <= 0) {
+          // past the end of the file or a read error, the rest reads as zero
+          break;
+        }
+        done += n;
+      }
+      memset((uint8_t *)page + done, 0, len - done);
+      break;
+    }
+    case PAGE_SOURCE_GEN:
+      src->gen(page, off, src->arg);
+      break;
+  }
+}
+
+static void resolve_fault(struct uffd_region *r, const struct uffd_msg *msg) {
+  uintptr_t addr = msg->arg.pagefault.address & ~(uintptr_t)(page_size() - 1);
+  bool write = msg->arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WRITE;
+  // a write to the zero page would fault again right away to copy it
+  bool zero = r->src.kind == PAGE_SOURCE_ZERO && !write;
+  if (!zero) {
+    page_source_fill(&r->src, r->page, addr - (uintptr_t)r->base);
+  }
+  // counted before the ioctl wakes the faulting thread, so the stats never
+  // lag behind what the application saw
+  atomic_fetch_add_explicit(&r->faults, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(zero ? &r->zero_pages : &r->copies, 1, memory_order_relaxed);
+  int rc;
+  do {
+    if (zero) {
+      struct uffdio_zeropage zp = { .range = { .start = addr, .len = page_size() } };
+      rc = ioctl(r->uffd, UFFDIO_ZEROPAGE, &zp);
+    } else {
+      struct uffdio_copy copy = {
+        .dst = addr, .src = (uintptr_t)r->page, .len = page_size(), .mode = 0,
+      };
+      rc = ioctl(r->uffd, UFFDIO_COPY, &copy);
+    }
+    // EAGAIN: the mappings changed meanwhile, the page is still missing
+  } while (rc == -1 && errno == EAGAIN);
+  if (rc == -1) {
+    if (errno != EEXIST) {
+      handler_fatal(zero ? "UFFDIO_ZEROPAGE" : "UFFDIO_COPY");
+    }
+    // another thread faulted on the same page and it is there already
+    atomic_fetch_sub_explicit(&r->faults, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(zero ? &r->zero_pages : &r->copies, 1, memory_order_relaxed);
+  }
+}
+
+static void *handler_thread(void *arg) {
+  struct uffd_region *r = arg;
+  struct uffd_msg msgs[UFFD_MSG_BATCH];
+  while (true) {
+    struct pollfd pfd[2] = {
+      { .fd = r->uffd, .events = POLLIN },
+      { .fd = r->stop_fd, .events = POLLIN },
+    };
+    if (poll(pfd, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      handler_fatal("poll on userfaultfd");
+    }
+    if (pfd[1].revents & POLLIN) {
+      return NULL;
+    }
+    ssize_t n = read(r->uffd, msgs, sizeof(msgs));
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EINTR) {
+        continue;
+      }
+      handler_fatal("read from userfaultfd");
+    }
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n / sizeof(*msgs); ++i) {
+      if (msgs[i].event != UFFD_EVENT_PAGEFAULT) {
+        continue;
+      }
+      resolve_fault(r, &msgs[i]);
+    }
+    atomic_fetch_add_explicit(&r->handler_ns, now_ns() - start, memory_order_relaxed);
+  }
+}
+
+int uffd_region_init(struct uffd_region *r, size_t len, const struct page_source *src) {
+  memset(r, 0, sizeof(*r));
+  r->len = (len + page_size() - 1) & ~(page_size() - 1);
+  r->src = *src;
+  r->stop_fd = -1;
+  r->base = MAP_FAILED;
+  r->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  if (r->uffd == -1) {
+    fprintf(stderr, "userfaultfd failed with errno %d\n", errno);
+    return -1;
+  }
+  struct uffdio_api api = { .api = UFFD_API, .features = 0 };
+  if (ioctl(r->uffd, UFFDIO_API, &api) == -1) {
+    fprintf(stderr, "UFFDIO_API failed with errno %d\n", errno);
+    goto fail;
+  }
+  r->base = mmap(NULL, r->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (r->base == MAP_FAILED) {
+    fprintf(stderr, "mmap of %zu bytes failed with errno %d\n", r->len, errno);
+    goto fail;
+  }
+  struct uffdio_register reg = {
+    .range = { .start = (uintptr_t)r->base, .len = r->len },
+    .mode = UFFDIO_REGISTER_MODE_MISSING,
+  };
+  if (ioctl(r->uffd, UFFDIO_REGISTER, &reg) == -1) {
+    fprintf(stderr, "UFFDIO_REGISTER failed with errno %d\n", errno);
+    goto fail;
+  }
+  r->page = aligned_alloc(page_size(), page_size());
+  r->stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (!r->page || r->stop_fd == -1) {
+    fprintf(stderr, "failed to set up the fault handler\n");
+    goto fail;
+  }
+  int err = pthread_create(&r->thread, NULL, handler_thread, r);
+  if (err != 0) {
+    fprintf(stderr, "pthread_create failed with errno %d\n", err);
+    goto fail;
+  }
+  return 0;
+
+fail:
+  if (r->base != MAP_FAILED) {
+    munmap(r->base, r->len);
+  }
+  if (r->stop_fd >= 0) {
+    close(r->stop_fd);
+  }
+  free(r->page);
+  close(r->uffd);
+  return -1;
+}
+
+void uffd_region_free(struct uffd_region *r) {
+  uint64_t one = 1;
+  if (write(r->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+    fprintf(stderr, "failed to stop the fault handler, errno %d\n", errno);
+  } else {
+    pthread_join(r->thread, NULL);
+  }
+  munmap(r->base, r->len);
+  close(r->stop_fd);
+  close(r->uffd);
+  free(r->page);
+}
+
+void uffd_region_stats(struct uffd_region *r, struct uffd_stats *stats) {
+  stats->faults = atomic_load(&r->faults);
+  stats->zero_pages = atomic_load(&r->zero_pages);
+  stats->copies = atomic_load(&r->copies);
+  stats->handler_ns = atomic_load(&r->handler_ns);
+}
@@ -0,0 +1,72 @@
+#ifndef UFFD_H
+#define UFFD_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// fills the page at byte offset off of a region
+typedef void (*page_gen_fn)(void *page, size_t off, void *arg);
+
+enum page_source_kind {
+  PAGE_SOURCE_ZERO,
+  PAGE_SOURCE_FILE,     // page at off comes from fd at file_off + off
+  PAGE_SOURCE_GEN,      // page is produced by gen
+};
+
+// where the contents of a page come from the first time it is touched
+struct page_source {
+  enum page_source_kind kind;
+  int fd;
+  off_t file_off;
+  page_gen_fn gen;
+  void *arg;
+};
+
+// writes the contents of the page at off to page. Only uses pread and
+// memset besides gen, so it may be called from a signal handler.
+void page_source_fill(const struct page_source *src, void *page, size_t off);
+
+// faults and pages are counted before the faulting thread is woken, the
+// handler time only once its whole batch is resolved
+struct uffd_stats {
+  uint64_t faults;
+  uint64_t zero_pages;    // resolved with UFFDIO_ZEROPAGE
+  uint64_t copies;        // resolved with UFFDIO_COPY
+  uint64_t handler_ns;    // time spent from reading a fault to resolving it
+};
+
+// anonymous region whose pages are populated on first touch by a handler
+// thread through userfaultfd, instead of by a SIGSEGV handler. The faulting
+// thread sleeps in the kernel until the handler installed the page, no
+// signal is delivered and the handler is an ordinary thread that may call
+// anything. Read faults on zero sources map the shared zero page, other
+// faults get a copy of a page filled from the source.
+struct uffd_region {
+  uint8_t *base;
+  size_t len;
+  struct page_source src;
+  int uffd;
+  int stop_fd;            // eventfd that tells the handler to exit
+  uint8_t *page;          // staging page for UFFDIO_COPY
+  pthread_t thread;
+  _Atomic uint64_t faults;
+  _Atomic uint64_t zero_pages;
+  _Atomic uint64_t copies;
+  _Atomic uint64_t handler_ns;
+};
+
+// maps len bytes, registers them with a new userfaultfd and starts the
+// handler thread. Fails if the kernel has no userfaultfd or it isn't
+// allowed for this user (vm.unprivileged_userfaultfd).
+int uffd_region_init(struct uffd_region *r, size_t len, const struct page_source *src);
+
+// stops the handler and unmaps the region
+void uffd_region_free(struct uffd_region *r);
+
+// counters of the handler, still valid after uffd_region_free
+void uffd_region_stats(struct uffd_region *r, struct uffd_stats *stats);
+
+#endif